@@ -0,0 +1,332 @@
+// PicoWi checksum benchmark, see https://iosoft.blog/picowi
+//
+// Copyright (c) 2022, Jeremy P Bentham
+//
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files (the "Software"), to deal
+// in the Software without restriction, including without limitation the rights
+// to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+// copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions:
+//
+// The above copyright notice and this permission notice shall be included in all
+// copies or substantial portions of the Software.
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+// OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+// SOFTWARE.
+
+#include <stdio.h>
+#include <string.h>
+
+// Can also be built & run on a host PC, to check the checksum engine:
+// cc -O2 -DCSUM_HOST -o csum_bench csum_bench.c lib/picowi_csum.c
+#ifdef CSUM_HOST
+#include <time.h>
+#include "lib/picowi_defs.h"
+#else
+#include "lib/picowi_defs.h"
+#include "lib/picowi_pico.h"
+#endif
+#include "lib/picowi_csum.h"
+
+// Number of times each test is repeated
+#define BENCH_COUNT     2000
+// Largest length tested, and full-size TCP data
+#define BENCH_MAXLEN    1536
+#define FRAME_DLEN      1460
+
+// Test vector: data, and its checksum in network byte order
+typedef struct {
+    char *name;
+    int len;
+    BYTE data[20];
+    BYTE sum[2];
+} CSUM_VECTOR;
+
+CSUM_VECTOR csum_vectors[] = {
+    {"Empty",           0,  {0},                                        {0x00, 0x00}},
+    {"Single byte",     1,  {0xab},                                     {0xab, 0x00}},
+    {"RFC 1071 example",8,  {0x00,0x01,0xf2,0x03,0xf4,0xf5,0xf6,0xf7},  {0xdd, 0xf2}},
+    {"Odd length",      5,  {0x12,0x34,0x56,0x78,0x9a},                 {0x02, 0xad}},
+    {"Carry wrap",      6,  {0xff,0xff,0xff,0xff,0x00,0x01},            {0x00, 0x01}},
+    {"IPv4 header",     20, {0x45,0x00,0x00,0x73,0x00,0x00,0x40,0x00,0x40,0x11,
+                             0x00,0x00,0xc0,0xa8,0x00,0x01,0xc0,0xa8,0x00,0xc7},
+                                                                        {0x47, 0x9e}},
+};
+
+BYTE bench_src[BENCH_MAXLEN + 8] __attribute__((aligned(4)));
+BYTE bench_dest[BENCH_MAXLEN + 8] __attribute__((aligned(4)));
+int bench_lens[] = {64, 256, 536, 1024, FRAME_DLEN};
+
+int csum_test_vectors(void);
+int csum_test_sweep(void);
+WORD ref_csum(BYTE *data, int len);
+WORD old_add_csum(WORD sum, void *dp, int count);
+WORD old_checksum(void *data, int len);
+uint32_t bench_old_add(BYTE *src, int len, WORD *sump);
+uint32_t bench_old_checksum(BYTE *src, int len, WORD *sump);
+uint32_t bench_data(BYTE *src, int len, WORD *sump);
+uint32_t bench_two_pass(BYTE *dest, BYTE *src, int len, WORD *sump);
+uint32_t bench_fused(BYTE *dest, BYTE *src, int len, WORD *sump);
+void bench_lengths(int oset);
+void bench_offsets(int len);
+
+#ifdef CSUM_HOST
+// Host microsecond timer
+uint32_t ustime(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ((uint32_t)(ts.tv_sec * 1000000 + ts.tv_nsec / 1000));
+}
+#endif
+
+int main() 
+{
+    int i, oset, errs;
+    
+#ifndef CSUM_HOST
+    io_init();
+    usdelay(1000000);
+#endif
+    printf("PicoWi checksum test & benchmark\n");
+    for (i = 0; i < sizeof(bench_src); i++)
+        bench_src[i] = (BYTE)(i * 7 + 3);
+    errs = csum_test_vectors() + csum_test_sweep();
+    printf("Checksum tests: %u error%s\n", errs, errs == 1 ? "" : "s");
+    // Destination offset 2 is the same as TCP data in a frame buffer,
+    // source offsets 0 and 2 are similarly aligned, 1 and 3 are not
+    printf("%u checksums of each length\n", BENCH_COUNT);
+    for (oset = 0; oset < 4; oset++)
+        bench_lengths(oset);
+    bench_offsets(FRAME_DLEN);
+#ifdef CSUM_HOST
+    return (errs != 0);
+#else
+    while (1)
+        usdelay(1000000);
+#endif
+}
+
+// Check the checksum engine against the test vectors, at all alignments
+int csum_test_vectors(void)
+{
+    CSUM_VECTOR *vp;
+    WORD sum;
+    BYTE *p;
+    int i, oset, errs = 0;
+
+    for (i = 0; i < sizeof(csum_vectors) / sizeof(CSUM_VECTOR); i++)
+    {
+        vp = &csum_vectors[i];
+        for (oset = 0; oset < 4; oset++)
+        {
+            p = &bench_dest[oset];
+            memcpy(p, vp->data, vp->len);
+            sum = csum_fold(csum_data(p, vp->len));
+            if (memcmp(&sum, vp->sum, 2) || ref_csum(p, vp->len) != sum ||
+                csum_fold(csum_copy(&bench_dest[BENCH_MAXLEN / 2 + oset], p, vp->len)) != sum)
+            {
+                printf("Vector '%s' offset %u: error\n", vp->name, oset);
+                errs++;
+            }
+        }
+    }
+    return (errs);
+}
+
+// Check all lengths, source & destination alignments against the reference
+int csum_test_sweep(void)
+{
+    int len, so, dofs, errs = 0;
+    WORD ref;
+    BYTE *s, *d;
+
+    for (so = 0; so < 4; so++)
+    {
+        for (dofs = 0; dofs < 4; dofs++)
+        {
+            for (len = 0; len <= BENCH_MAXLEN; len++)
+            {
+                s = &bench_src[so];
+                d = &bench_dest[dofs];
+                ref = ref_csum(s, len);
+                memset(bench_dest, 0, sizeof(bench_dest));
+                if (csum_fold(csum_data(s, len)) != ref ||
+                    old_checksum(s, len) != (WORD)~ref ||
+                    csum_fold(csum_copy(d, s, len)) != ref ||
+                    memcmp(d, s, len) || d[len] != 0)
+                {
+                    if (errs++ < 10)
+                        printf("Source offset %u, dest offset %u, length %u: error\n", so, dofs, len);
+                }
+            }
+        }
+    }
+    return (errs);
+}
+
+// Reference checksum, one byte at a time
+WORD ref_csum(BYTE *data, int len)
+{
+    DWORD sum = 0;
+    int i;
+
+    for (i = 0; i < len; i++)
+        sum += i & 1 ? data[i] << 8 : data[i];
+    while (sum >> 16)
+        sum = (sum & 0xffff) + (sum >> 16);
+    return ((WORD)sum);
+}
+
+// Previous IP checksum, 16-bit loads, carry folded on every word
+WORD old_add_csum(WORD sum, void *dp, int count)
+{
+    WORD n=count>>1, *p=(WORD *)dp, last=sum;
+
+    while (n--)
+    {
+        sum += *p++;
+        if (sum < last)
+            sum++;
+        last = sum;
+    }
+    if (count & 1)
+        sum += *p & 0x00ff;
+    if (sum < last)
+        sum++;
+    return(sum);
+}
+
+// Previous TCP checksum, 16-bit loads into a 32-bit accumulator
+WORD old_checksum(void *data, int len)
+{
+    WORD *buff = data;
+    DWORD cksum = 0;
+    while (len > 1)
+    {
+        cksum += *buff++;
+        len -= sizeof(WORD);
+    }
+    if (len)
+        cksum += *(BYTE *)buff;
+    cksum = (cksum >> 16) + (cksum & 0xffff);
+    cksum += (cksum >> 16);
+    return (WORD)(~cksum);
+}
+
+// Time & display the checksum methods, for a given source offset
+void bench_lengths(int oset)
+{
+    DWORD t1, t2, t3, t4, t5;
+    WORD sum1, sum2, sum3, sum4, sum5;
+    int i, n;
+
+    printf("Source offset %u\n", oset);
+    printf("Bytes  old_add  old_tcp  csum_data  copy+sum  csum_copy (usec)\n");
+    for (i = 0; i < sizeof(bench_lens) / sizeof(int); i++)
+    {
+        n = bench_lens[i];
+        // The old routines make 16-bit loads, so fault on an odd address
+        if (oset & 1)
+            t1 = t2 = 0, sum1 = sum2 = ref_csum(&bench_src[oset], n);
+        else
+        {
+            t1 = bench_old_add(&bench_src[oset], n, &sum1);
+            t2 = bench_old_checksum(&bench_src[oset], n, &sum2);
+        }
+        t3 = bench_data(&bench_src[oset], n, &sum3);
+        t4 = bench_two_pass(&bench_dest[2], &bench_src[oset], n, &sum4);
+        t5 = bench_fused(&bench_dest[2], &bench_src[oset], n, &sum5);
+        printf("%5u %8u %8u %10u %9u %10u  %s\n", n, t1, t2, t3, t4, t5,
+            sum1 == sum3 && sum2 == sum3 && sum4 == sum3 && sum5 == sum3 ? "" : "MISMATCH");
+    }
+}
+
+// Time & display copy with checksum, for all source & destination offsets
+void bench_offsets(int len)
+{
+    DWORD t1, t2;
+    WORD sum1, sum2;
+    int so, dofs;
+
+    printf("%u-byte copy & checksum, two-pass / fused (usec)\n", len);
+    printf("Source  Dest 0       Dest 1       Dest 2       Dest 3\n");
+    for (so = 0; so < 4; so++)
+    {
+        printf("%6u", so);
+        for (dofs = 0; dofs < 4; dofs++)
+        {
+            t1 = bench_two_pass(&bench_dest[dofs], &bench_src[so], len, &sum1);
+            t2 = bench_fused(&bench_dest[dofs], &bench_src[so], len, &sum2);
+            printf("  %5u/%5u%s", t1, t2, sum1 == sum2 ? "" : "!");
+        }
+        printf("\n");
+    }
+}
+
+// Time the old IP checksum
+uint32_t bench_old_add(BYTE *src, int len, WORD *sump)
+{
+    uint32_t t = ustime();
+    int i;
+
+    for (i = 0; i < BENCH_COUNT; i++)
+        *sump = old_add_csum(0, src, len);
+    return (ustime() - t);
+}
+
+// Time the old TCP checksum
+uint32_t bench_old_checksum(BYTE *src, int len, WORD *sump)
+{
+    uint32_t t = ustime();
+    int i;
+
+    for (i = 0; i < BENCH_COUNT; i++)
+        *sump = ~old_checksum(src, len);
+    return (ustime() - t);
+}
+
+// Time the checksum engine
+uint32_t bench_data(BYTE *src, int len, WORD *sump)
+{
+    uint32_t t = ustime();
+    int i;
+
+    for (i = 0; i < BENCH_COUNT; i++)
+        *sump = csum_fold(csum_data(src, len));
+    return (ustime() - t);
+}
+
+// Time the copy & checksum as separate passes
+uint32_t bench_two_pass(BYTE *dest, BYTE *src, int len, WORD *sump)
+{
+    uint32_t t = ustime();
+    int i;
+    
+    for (i = 0; i < BENCH_COUNT; i++)
+    {
+        memcpy(dest, src, len);
+        *sump = ~checksum(dest, len);
+    }
+    return (ustime() - t);
+}
+
+// Time the fused copy & checksum
+uint32_t bench_fused(BYTE *dest, BYTE *src, int len, WORD *sump)
+{
+    uint32_t t = ustime();
+    int i;
+    
+    for (i = 0; i < BENCH_COUNT; i++)
+        *sump = csum_fold(csum_copy(dest, src, len));
+    return (ustime() - t);
+}
+
+// EOF
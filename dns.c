@@ -52,7 +52,7 @@ int main()
 {
     uint32_t led_ticks, poll_ticks, dns_ticks;
     bool ledon=false;
-    MACADDR mac;
+    MACADDR mac = {0};
     
     add_event_handler(join_event_handler);
     add_event_handler(arp_event_handler);
@@ -86,6 +86,7 @@ int main()
             {
                 event_poll();
                 join_state_poll(SSID, PASSWD);
+                ip_arp_poll();
                 ustimeout(&poll_ticks, 0);
             }
             // If link is up, poll DHCP state machine
@@ -102,15 +103,10 @@ int main()
                 dhcp_complete = 2;
                 ustimeout(&dns_ticks, 0);
             }
+            // Send DNS request; with zero MAC address, it goes to the
+            // next hop, after ARP if necessary
             if (dhcp_complete && ustimeout(&dns_ticks, 1000000))
-            {
-                if (!ip_find_arp(router_ip, mac))
-                    ip_tx_arp(mac, router_ip, ARPREQ);
-                else
-                {
-                    dns_tx(mac, dns_ip, LOCAL_PORT, SERVER_NAME);
-                }
-            }
+                dns_tx(mac, dns_ip, LOCAL_PORT, SERVER_NAME);
         }
     }
 }
@@ -0,0 +1,79 @@
+// PicoWi network buffer pool, see https://iosoft.blog/picowi
+//
+// Copyright (c) 2022, Jeremy P Bentham
+//
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files (the "Software"), to deal
+// in the Software without restriction, including without limitation the rights
+// to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+// copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions:
+//
+// The above copyright notice and this permission notice shall be included in all
+// copies or substantial portions of the Software.
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+// OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+// SOFTWARE.
+
+#include <stdio.h>
+#include <string.h>
+
+#include "picowi_defs.h"
+#include "picowi_ip.h"
+#include "picowi_buff.h"
+
+// Frame buffer, with flag if in use
+typedef struct {
+    int used;
+    BYTE data[NET_BUFF_SIZE];
+} NET_BUFF;
+
+NET_BUFF net_buffs[NUM_NET_BUFFS] __attribute__((aligned(4)));
+
+// Return pool entry for a buffer, null pointer if not in pool
+static NET_BUFF *buff_entry(BYTE *buff)
+{
+    int i = buff ? (buff - net_buffs[0].data) / (int)sizeof(NET_BUFF) : -1;
+
+    return (i >= 0 && i < NUM_NET_BUFFS && net_buffs[i].data == buff ? &net_buffs[i] : 0);
+}
+
+// Get a frame buffer from the pool, return null pointer if none free
+BYTE *buff_alloc(void)
+{
+    for (int i = 0; i < NUM_NET_BUFFS; i++)
+    {
+        if (!net_buffs[i].used)
+        {
+            net_buffs[i].used = 1;
+            return (net_buffs[i].data);
+        }
+    }
+    return (0);
+}
+
+// Return a frame buffer to the pool
+void buff_free(BYTE *buff)
+{
+    NET_BUFF *nbp = buff_entry(buff);
+
+    if (nbp)
+        nbp->used = 0;
+}
+
+// Return the number of free frame buffers
+int buff_num_free(void)
+{
+    int i, n = 0;
+
+    for (i = 0; i < NUM_NET_BUFFS; i++)
+        n += !net_buffs[i].used;
+    return (n);
+}
+
+// EOF
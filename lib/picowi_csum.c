@@ -0,0 +1,228 @@
+// PicoWi Internet checksum functions, see https://iosoft.blog/picowi
+//
+// Copyright (c) 2022, Jeremy P Bentham
+//
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files (the "Software"), to deal
+// in the Software without restriction, including without limitation the rights
+// to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+// copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions:
+//
+// The above copyright notice and this permission notice shall be included in all
+// copies or substantial portions of the Software.
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+// OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+// SOFTWARE.
+
+#include <stdint.h>
+#include <string.h>
+
+#include "picowi_defs.h"
+#include "picowi_csum.h"
+
+// Add the two 16-bit halves of a 32-bit word to a checksum
+#define CSUM_ADD32(sum, w)  sum += ((w) & 0xffff) + ((w) >> 16)
+
+// Copy & checksum a multiple of 4 bytes from an aligned source, to a
+// destination that is 'sh' bits past alignment; return unfolded sum
+// Bytes of the first word are stored until the destination is aligned,
+// then the remainder is merged with the next word, so stores are 32-bit
+static inline DWORD csum_merge(BYTE *d, const BYTE *s, int len, int sh)
+{
+    DWORD sum = 0, w, hi;
+    int n;
+
+    hi = *(const DWORD *)s;
+    CSUM_ADD32(sum, hi);
+    for (n = 4 - sh / 8; n > 0; n--, hi >>= 8)
+        *d++ = (BYTE)hi;
+    s += 4, len -= 4;
+    while (len >= 16)
+    {
+        w = ((const DWORD *)s)[0];
+        CSUM_ADD32(sum, w);
+        ((DWORD *)d)[0] = hi | (w << sh);
+        hi = ((const DWORD *)s)[1];
+        CSUM_ADD32(sum, hi);
+        ((DWORD *)d)[1] = (w >> (32 - sh)) | (hi << sh);
+        w = ((const DWORD *)s)[2];
+        CSUM_ADD32(sum, w);
+        ((DWORD *)d)[2] = (hi >> (32 - sh)) | (w << sh);
+        hi = ((const DWORD *)s)[3];
+        CSUM_ADD32(sum, hi);
+        ((DWORD *)d)[3] = (w >> (32 - sh)) | (hi << sh);
+        hi >>= 32 - sh;
+        d += 16, s += 16, len -= 16;
+    }
+    while (len >= 4)
+    {
+        w = *(const DWORD *)s;
+        CSUM_ADD32(sum, w);
+        *(DWORD *)d = hi | (w << sh);
+        hi = w >> (32 - sh);
+        d += 4, s += 4, len -= 4;
+    }
+    for (n = sh / 8; n > 0; n--, hi >>= 8)
+        *d++ = (BYTE)hi;
+    return (sum);
+}
+
+// Copy data, and return its checksum, so the data is only read once
+// The checksum is an unfolded sum of 16-bit words, as if the data starts
+// at an even offset; the length must be less than 64K bytes
+// 32-bit words are loaded from the source; if the destination is aligned
+// differently (e.g. TCP data in a frame buffer) adjacent words are merged
+DWORD csum_copy(void *dest, const void *src, int len)
+{
+    BYTE *d = dest;
+    const BYTE *s = src;
+    DWORD sum = 0, wsum = 0, w;
+    int swap = 0, n, sh;
+
+    // Odd start: the following words have their bytes swapped
+    if (((uintptr_t)s & 1) && len > 0)
+    {
+        sum = *d++ = *s++;
+        len--;
+        swap = 1;
+    }
+    if (((uintptr_t)s & 2) && len > 1)
+    {
+        wsum += *(const WORD *)s;
+        d[0] = s[0];
+        d[1] = s[1];
+        d += 2, s += 2, len -= 2;
+    }
+    // Source is now aligned; get the destination offset in bits
+    sh = ((uintptr_t)d & 3) * 8;
+    if (sh == 0)
+    {
+        while (len >= 16)
+        {
+            w = ((DWORD *)d)[0] = ((const DWORD *)s)[0];
+            CSUM_ADD32(wsum, w);
+            w = ((DWORD *)d)[1] = ((const DWORD *)s)[1];
+            CSUM_ADD32(wsum, w);
+            w = ((DWORD *)d)[2] = ((const DWORD *)s)[2];
+            CSUM_ADD32(wsum, w);
+            w = ((DWORD *)d)[3] = ((const DWORD *)s)[3];
+            CSUM_ADD32(wsum, w);
+            d += 16, s += 16, len -= 16;
+        }
+        while (len >= 4)
+        {
+            w = *(DWORD *)d = *(const DWORD *)s;
+            CSUM_ADD32(wsum, w);
+            d += 4, s += 4, len -= 4;
+        }
+    }
+    // Otherwise merge adjacent words, with a constant shift for speed
+    else if (len >= 4)
+    {
+        n = len & ~3;
+        wsum += sh == 8 ? csum_merge(d, s, n, 8) : sh == 16 ?
+                csum_merge(d, s, n, 16) : csum_merge(d, s, n, 24);
+        d += n, s += n, len -= n;
+    }
+    if (len >= 2)
+    {
+        wsum += *(const WORD *)s;
+        d[0] = s[0];
+        d[1] = s[1];
+        d += 2, s += 2, len -= 2;
+    }
+    if (len)
+        wsum += *d = *s;
+    return (sum + (swap ? csum_swap(wsum) : wsum));
+}
+
+// Return the checksum of data, as an unfolded sum of 16-bit words,
+// as if the data starts at an even offset; it must be less than 64K bytes
+DWORD csum_data(const void *data, int len)
+{
+    const BYTE *p = data;
+    DWORD sum = 0, wsum = 0, w;
+    int swap = 0;
+
+    // Odd start: the following words have their bytes swapped
+    if (((uintptr_t)p & 1) && len > 0)
+    {
+        sum = *p++;
+        len--;
+        swap = 1;
+    }
+    if (((uintptr_t)p & 2) && len > 1)
+    {
+        wsum += *(const WORD *)p;
+        p += 2, len -= 2;
+    }
+    while (len >= 16)
+    {
+        w = ((const DWORD *)p)[0];
+        CSUM_ADD32(wsum, w);
+        w = ((const DWORD *)p)[1];
+        CSUM_ADD32(wsum, w);
+        w = ((const DWORD *)p)[2];
+        CSUM_ADD32(wsum, w);
+        w = ((const DWORD *)p)[3];
+        CSUM_ADD32(wsum, w);
+        p += 16, len -= 16;
+    }
+    while (len >= 4)
+    {
+        w = *(const DWORD *)p;
+        CSUM_ADD32(wsum, w);
+        p += 4, len -= 4;
+    }
+    if (len >= 2)
+    {
+        wsum += *(const WORD *)p;
+        p += 2, len -= 2;
+    }
+    if (len)
+        wsum += *p;
+    return (sum + (swap ? csum_swap(wsum) : wsum));
+}
+
+// Fold a checksum into 16 bits
+WORD csum_fold(DWORD sum)
+{
+    sum = (sum >> 16) + (sum & 0xffff);
+    sum += sum >> 16;
+    return ((WORD)sum);
+}
+
+// Fold a checksum, and swap its bytes, for data at an odd offset
+DWORD csum_swap(DWORD sum)
+{
+    WORD w = csum_fold(sum);
+
+    return ((DWORD)((w >> 8) | (w << 8)) & 0xffff);
+}
+
+// Update a header checksum when a 16-bit field changes, without
+// recalculating it, using RFC 1624 equation 3: HC' = ~(~HC + ~m + m')
+WORD csum_update(WORD check, WORD old, WORD new)
+{
+    return ((WORD)~csum_fold((DWORD)(WORD)~check + (WORD)~old + new));
+}
+
+// Calculate TCP-style checksum, add to old value
+WORD add_csum(WORD sum, void *dp, int count)
+{
+    return (csum_fold(sum + csum_data(dp, count)));
+}
+
+// Return the complemented checksum of a data block
+WORD checksum(void *data, int len)
+{
+    return ((WORD)~csum_fold(csum_data(data, len)));
+}
+
+// EOF
@@ -207,24 +207,31 @@ char *event_str(int event)
 
 // Transmit network data
 int event_net_tx(void *data, int len)
+{
+    return (event_net_tx2(0, 0, data, len));
+}
+
+// Transmit network data as a header and data block
+// The header is copied after the SDPCM header, the data is sent directly
+// from its buffer, which must remain unchanged until the call returns
+int event_net_tx2(void *hdr, int hlen, const void *data, int dlen)
 {
     TX_MSG *txp = &tx_msg;
-    uint8_t *dp = (uint8_t *)txp;
-    int txlen = sizeof(SDPCM_HDR)+2+sizeof(BDC_HDR)+len;
+    int txlen = sizeof(SDPCM_HDR)+2+sizeof(BDC_HDR)+hlen;
     
-    display(DISP_DATA, "Tx_DATA len %d\n", len);
-    disp_bytes(DISP_DATA, data, len);
+    display(DISP_DATA, "Tx_DATA len %d\n", hlen + dlen);
+    disp_bytes(DISP_DATA, hdr, hlen);
+    disp_bytes(DISP_DATA, (void *)data, dlen);
     display(DISP_DATA, "\n");
-    txp->sdpcm.len = txlen;
+    txp->sdpcm.len = txlen + dlen;
     txp->sdpcm.notlen = ~txp->sdpcm.len;
     txp->sdpcm.seq = sd_tx_seq++;
-    memcpy(txp->data, data, len);
+    if (hlen > 0)
+        memcpy(txp->data, hdr, hlen);
     if (!wifi_reg_val_wait(10, SD_FUNC_BUS, SPI_STATUS_REG, 
             SPI_STATUS_F2_RX_READY, SPI_STATUS_F2_RX_READY, 4))
         return(0);
-    while (txlen & 3)
-        dp[txlen++] = 0;
-    return (wifi_data_write(SD_FUNC_RAD, 0, dp, txlen));
+    return (wifi_data_write2(SD_FUNC_RAD, 0, (uint8_t *)txp, txlen, (uint8_t *)data, dlen));
 }
 
 // EOF
@@ -134,5 +134,6 @@ int event_get_resp(void *data, int maxlen);
 char *sdpcm_chan_str(int chan);
 char *event_str(int event);
 int event_net_tx(void *data, int len);
+int event_net_tx2(void *hdr, int hlen, const void *data, int dlen);
 
 // EOF
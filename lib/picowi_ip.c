@@ -28,18 +28,22 @@
 #include "picowi_ioctl.h"
 #include "picowi_event.h"
 #include "picowi_ip.h"
+#include "picowi_csum.h"
+#include "picowi_buff.h"
 
 extern int display_mode;
 IPADDR my_ip, bcast_ip=IPADDR_VAL(255,255,255,255);
 IPADDR zero_ip=IPADDR_VAL(0, 0, 0, 0);
 MACADDR bcast_mac={0xff,0xff,0xff,0xff,0xff,0xff};
 extern MACADDR my_mac;
+extern IPADDR router_ip, subnet_mask;
 BYTE txbuff[TXDATA_LEN];
 
-#define NUM_ARP_ENTRIES 10
 ARP_ENTRY arp_entries[NUM_ARP_ENTRIES];
-int arp_idx;
+int arp_idx;                        // Entry found by last lookup
+ARP_QENTRY arp_queue[ARP_QUEUE_LEN];
 uint32_t ping_tx_time, ping_rx_time;
+WORD ip_ident=1;                    // Identification value for next frame
 
 
 // Initialise the IP stack, using static address if provided
@@ -57,13 +61,29 @@ void ip_set_mac(BYTE *mac)
 }
 
 // Send transmit data
+// An IP frame with a zero destination MAC address is sent to the next hop
+// when its address has been resolved, using the ARP cache, or is queued
+// while waiting
 int ip_tx_eth(BYTE *buff, int len)
 {
+    ETHERHDR *ehp = (ETHERHDR *)buff;
+
+    if (!MAC_IS_NONZERO(ehp->dest) && htons(ehp->ptype) == PCOL_IP)
+        return (ip_arp_resolve(buff, len));
     if (display_mode & DISP_ETH)
         ip_print_eth(buff);
     return(event_net_tx(buff, len));
 }
 
+// Send Ethernet frame headers from a buffer, followed by data from
+// another buffer, without copying the data
+int ip_tx_eth2(BYTE *buff, int len, const BYTE *data, int dlen)
+{
+    if (display_mode & DISP_ETH)
+        ip_print_eth(buff);
+    return(event_net_tx2(buff, len, data, dlen));
+}
+
 // Add Ethernet header to buffer, return byte count
 int ip_add_eth(BYTE *buff, MACADDR dmac, MACADDR smac, WORD pcol)
 {
@@ -117,12 +137,16 @@ int ip_rx_arp(BYTE *data, int dlen)
     {
         if (display_mode & DISP_ARP)
             ip_print_arp(arp);
+        // Save the sender's address, as it is likely to be needed (RFC 826)
+        if ((op == ARPREQ || op == ARPRESP) && !IP_IS_ZERO(arp->sip))
+            ip_save_arp(arp->smac, arp->sip);
         if (op == ARPREQ)
             ip_tx_arp(ehp->srce, arp->sip, ARPRESP);
-        else if (op == ARPRESP)
-            ip_save_arp(arp->smac, arp->sip);
         return(1);
     }
+    // Update an existing entry if another node's address has changed
+    if ((op == ARPREQ || op == ARPRESP) && ip_arp_entry(arp->sip) >= 0)
+        ip_save_arp(arp->smac, arp->sip);
     return(0);
 }
 
@@ -154,28 +178,210 @@ int ip_tx_arp(MACADDR mac, IPADDR addr, WORD op)
     return(ip_tx_eth(txbuff, n));
  }
  
-// Save ARP result
+// Save ARP result, updating the entry if the address is already present,
+// then send any frames that were waiting for it
 void ip_save_arp(MACADDR mac, IPADDR addr)
 {
-    MAC_CPY(arp_entries[arp_idx].mac, mac);
-    IP_CPY(arp_entries[arp_idx].ipaddr, addr);
-    arp_idx = (arp_idx+1) % NUM_ARP_ENTRIES;
+    int i = ip_arp_entry(addr);
+    ARP_ENTRY *ap;
+
+    if (i < 0)
+        i = ip_arp_new_entry(addr);
+    ap = &arp_entries[i];
+    MAC_CPY(ap->mac, mac);
+    ap->state = ARP_VALID;
+    ap->tries = ap->refresh = 0;
+    ap->ticks = ustime();
+    ip_arp_send_queued(addr, 1);
 }
 
-// Find saved ARP response
+// Find saved ARP response, return 0 if not found or expired
+// An entry that is in use is marked to be refreshed before it expires;
+// the request is sent by ip_arp_poll, since the caller's frame may be
+// in the transmit buffer
 bool ip_find_arp(IPADDR addr, MACADDR mac)
 {
-    int n=0, i=arp_idx;
-    bool ok=0;
-    
-    do
+    int i = ip_arp_entry(addr);
+    ARP_ENTRY *ap;
+    uint32_t t = ustime();
+
+    if (i < 0)
+        return (0);
+    ap = &arp_entries[i];
+    if (ap->state != ARP_VALID || t - ap->ticks >= ARP_TIMEOUT_USEC)
+        return (0);
+    MAC_CPY(mac, ap->mac);
+    ap->used_ticks = t;
+    if (t - ap->ticks >= ARP_REFRESH_USEC)
+        ap->refresh = 1;
+    return (1);
+}
+
+// Return index of ARP cache entry for an address, -ve if none
+// The entry found last time is checked first
+int ip_arp_entry(IPADDR addr)
+{
+    ARP_ENTRY *ap = &arp_entries[arp_idx];
+    int i;
+
+    if (ap->state != ARP_FREE && IP_CMP(addr, ap->ipaddr))
+        return (arp_idx);
+    for (i = 0, ap = arp_entries; i < NUM_ARP_ENTRIES; i++, ap++)
+    {
+        if (ap->state != ARP_FREE && IP_CMP(addr, ap->ipaddr))
+            return (arp_idx = i);
+    }
+    return (-1);
+}
+
+// Get a new ARP cache entry for an address, return its index
+// If the cache is full, replace the entry that was used least recently,
+// preferring one that is not awaiting a response
+int ip_arp_new_entry(IPADDR addr)
+{
+    ARP_ENTRY *ap;
+    uint32_t t = ustime(), age, oldest = 0;
+    int i, n = 0;
+
+    for (i = 0, ap = arp_entries; i < NUM_ARP_ENTRIES; i++, ap++)
+    {
+        if (ap->state == ARP_FREE)
+        {
+            n = i;
+            break;
+        }
+        age = t - ap->used_ticks + (ap->state == ARP_VALID ? ARP_TIMEOUT_USEC : 0);
+        if (age >= oldest)
+        {
+            oldest = age;
+            n = i;
+        }
+    }
+    ap = &arp_entries[n];
+    if (ap->state == ARP_PENDING)
+        ip_arp_send_queued(ap->ipaddr, 0);
+    memset(ap, 0, sizeof(ARP_ENTRY));
+    IP_CPY(ap->ipaddr, addr);
+    ap->state = ARP_PENDING;
+    ap->used_ticks = t;
+    return (arp_idx = n);
+}
+
+// Send an IP frame if its destination MAC address is known, otherwise
+// put a copy in the queue, and send an ARP request if not already sent
+// Return 0 if the frame can't be queued
+int ip_arp_resolve(BYTE *buff, int len)
+{
+    ETHERHDR *ehp = (ETHERHDR *)buff;
+    IPHDR *ip = (IPHDR *)&buff[sizeof(ETHERHDR)];
+    ARP_QENTRY *qp = arp_queue;
+    ARP_ENTRY *ap;
+    BYTE *hop = ip_next_hop(ip->dip);
+    int i;
+
+    if (ip_is_bcast(ip->dip))
+        MAC_CPY(ehp->dest, bcast_mac);
+    if (ip_is_bcast(ip->dip) || ip_find_arp(hop, ehp->dest))
+        return (ip_tx_eth(buff, len));
+    for (i = 0; i < ARP_QUEUE_LEN && qp->buff; i++, qp++) ;
+    if (i >= ARP_QUEUE_LEN || len > NET_BUFF_SIZE || !(qp->buff = buff_alloc()))
+        return (0);
+    memcpy(qp->buff, buff, len);
+    qp->len = len;
+    if ((i = ip_arp_entry(hop)) < 0)
+        i = ip_arp_new_entry(hop);
+    ap = &arp_entries[i];
+    if (ap->state == ARP_VALID)
+    {
+        ap->state = ARP_PENDING;
+        ap->tries = 0;
+    }
+    if (ap->tries == 0)
     {
-        i = i == 0 ? NUM_ARP_ENTRIES-1 : i-1;
-        ok = (IP_CMP(addr, arp_entries[i].ipaddr));
-    } while (!ok && ++n<NUM_ARP_ENTRIES);
-    if (ok)
-        MAC_CPY(mac, arp_entries[i].mac);
-    return(ok);
+        ap->tries = 1;
+        ap->req_ticks = ustime();
+        ip_tx_arp(ap->mac, ap->ipaddr, ARPREQ);
+    }
+    return (len);
+}
+
+// Send the queued frames for a next-hop address that has been resolved,
+// or discard them if it can't be resolved
+void ip_arp_send_queued(IPADDR addr, bool ok)
+{
+    ARP_QENTRY *qp = arp_queue;
+    IPHDR *ip;
+
+    for (int i = 0; i < ARP_QUEUE_LEN; i++, qp++)
+    {
+        if (!qp->buff)
+            continue;
+        ip = (IPHDR *)&qp->buff[sizeof(ETHERHDR)];
+        if (IP_CMP(ip_next_hop(ip->dip), addr))
+        {
+            if (ok && ip_find_arp(addr, ((ETHERHDR *)qp->buff)->dest))
+                ip_tx_eth(qp->buff, qp->len);
+            buff_free(qp->buff);
+            qp->buff = 0;
+        }
+    }
+}
+
+// Return the next-hop address for a destination: the destination itself
+// if it is on the local subnet, otherwise the router
+// If the subnet mask or router isn't known, all addresses are local
+BYTE *ip_next_hop(IPADDR dip)
+{
+    if (IP_IS_ZERO(router_ip) || IP_IS_ZERO(subnet_mask) ||
+        (((dip[0] ^ my_ip[0]) & subnet_mask[0]) == 0 &&
+         ((dip[1] ^ my_ip[1]) & subnet_mask[1]) == 0 &&
+         ((dip[2] ^ my_ip[2]) & subnet_mask[2]) == 0 &&
+         ((dip[3] ^ my_ip[3]) & subnet_mask[3]) == 0))
+        return (dip);
+    return (router_ip);
+}
+
+// Check if an address is a broadcast, either to all hosts, or the subnet
+bool ip_is_bcast(IPADDR dip)
+{
+    return (IP_IS_BCAST(dip) || (!IP_IS_ZERO(subnet_mask) &&
+        (dip[0] | subnet_mask[0]) == 0xff && (dip[1] | subnet_mask[1]) == 0xff &&
+        (dip[2] | subnet_mask[2]) == 0xff && (dip[3] | subnet_mask[3]) == 0xff));
+}
+
+// Resend ARP requests that haven't had a response, refresh entries
+// that are in use, and remove entries that have failed, or expired
+void ip_arp_poll(void)
+{
+    ARP_ENTRY *ap = arp_entries;
+    uint32_t t = ustime();
+
+    for (int i = 0; i < NUM_ARP_ENTRIES; i++, ap++)
+    {
+        if (ap->state == ARP_PENDING && t - ap->req_ticks >= ARP_RETRY_USEC)
+        {
+            if (ap->tries >= ARP_TRIES)
+            {
+                ip_arp_send_queued(ap->ipaddr, 0);
+                ap->state = ARP_FREE;
+            }
+            else
+            {
+                ap->tries++;
+                ap->req_ticks = t;
+                ip_tx_arp(ap->mac, ap->ipaddr, ARPREQ);
+            }
+        }
+        else if (ap->state == ARP_VALID && t - ap->ticks >= ARP_TIMEOUT_USEC)
+            ap->state = ARP_FREE;
+        else if (ap->state == ARP_VALID && ap->refresh && ap->tries < ARP_TRIES &&
+                 (ap->tries == 0 || t - ap->req_ticks >= ARP_RETRY_USEC))
+        {
+            ap->tries++;
+            ap->req_ticks = t;
+            ip_tx_arp(ap->mac, ap->ipaddr, ARPREQ);
+        }
+    }
 }
 
 // Display ARP
@@ -207,10 +413,9 @@ int ip_check_frame(BYTE *data, int dlen)
 // Add IP header to buffer, return length
 int ip_add_hdr(BYTE *buff, IPADDR dip, BYTE pcol, WORD dlen)
 {
-    static WORD ident=1;
     IPHDR *ip=(IPHDR *)buff;
 
-    ip->ident = htons(ident++);
+    ip->ident = htons(ip_ident++);
     ip->frags = 0;
     ip->vhl = 0x40+(sizeof(IPHDR)>>2);
     ip->service = 0;
@@ -224,6 +429,33 @@ int ip_add_hdr(BYTE *buff, IPADDR dip, BYTE pcol, WORD dlen)
     return(sizeof(IPHDR));
 }
 
+// Make IP header template, with zero ident & length
+void ip_make_tmpl(IPHDR *ip, IPADDR dip, BYTE pcol)
+{
+    ip->vhl = 0x40+(sizeof(IPHDR)>>2);
+    ip->service = 0;
+    ip->len = ip->ident = ip->frags = 0;
+    ip->ttl = 100;
+    ip->pcol = pcol;
+    IP_CPY(ip->sip, my_ip);
+    IP_CPY(ip->dip, dip);
+    ip->check = 0;
+    ip->check = 0xffff ^ add_csum(0, ip, sizeof(IPHDR));
+}
+
+// Add IP header to buffer from a template, return length
+// Only the ident & length are changed, so the checksum is updated
+int ip_add_hdr_tmpl(BYTE *buff, IPHDR *tmpl, WORD dlen)
+{
+    IPHDR *ip=(IPHDR *)buff;
+
+    memcpy(ip, tmpl, sizeof(IPHDR));
+    ip->ident = htons(ip_ident++);
+    ip->len = htons(dlen + sizeof(IPHDR));
+    ip->check = csum_update(csum_update(tmpl->check, 0, ip->ident), 0, ip->len);
+    return(sizeof(IPHDR));
+}
+
 /*** ICMP ***/
 
 // Handler for incoming ICMP frame
@@ -248,6 +480,7 @@ int ip_rx_icmp(BYTE *data, int dlen)
     ETHERHDR *ehp=(ETHERHDR *)data;
     IPHDR *ip = (IPHDR *)&data[sizeof(ETHERHDR)];
     ICMPHDR *icmp = (ICMPHDR *)&data[sizeof(ETHERHDR)+sizeof(IPHDR)];
+    WORD w;
     int n;
 
     if (display_mode & DISP_ICMP)
@@ -257,8 +490,9 @@ int ip_rx_icmp(BYTE *data, int dlen)
         ip_add_eth(data, ehp->srce, my_mac, PCOL_IP);
         IP_CPY(ip->dip, ip->sip);
         IP_CPY(ip->sip, my_ip);
-        icmp->check = add_csum(icmp->check, &icmp->type, 1);
+        w = *(WORD *)&icmp->type;
         icmp->type = ICREP;
+        icmp->check = csum_update(icmp->check, w, *(WORD *)&icmp->type);
         n = htons(ip->len);
         return(ip_tx_eth(data, sizeof(ETHERHDR)+n+sizeof(ICMPHDR)));
     }
@@ -274,14 +508,16 @@ int ip_add_icmp(BYTE *buff, BYTE type, BYTE code, void *data, WORD dlen)
 {
     ICMPHDR *icmp=(ICMPHDR *)buff;
     WORD len=sizeof(ICMPHDR);
+    DWORD dsum;
     static WORD seq=1;
 
     icmp->type = type;
     icmp->code = code;
     icmp->seq = htons(seq++);
     icmp->ident = icmp->check = 0;
-    len += ip_add_data(&buff[len], data, dlen);
-    icmp->check = 0xffff ^ add_csum(0, icmp, len);
+    dsum = data ? csum_copy(&buff[len], data, dlen) : csum_data(&buff[len], dlen);
+    len += dlen;
+    icmp->check = 0xffff ^ add_csum(csum_fold(dsum), icmp, sizeof(ICMPHDR));
     return(len);
 }
 
@@ -385,23 +621,4 @@ DWORD htonl(DWORD x)
            (((x) & 0x0000ff00u) <<  8) | (((x) & 0x000000ffu) << 24));
 }
 
-/* Calculate TCP-style checksum, add to old value */
-WORD add_csum(WORD sum, void *dp, int count)
-{
-    WORD n=count>>1, *p=(WORD *)dp, last=sum;
-
-    while (n--)
-    {
-        sum += *p++;
-        if (sum < last)
-            sum++;
-        last = sum;
-    }
-    if (count & 1)
-        sum += *p & 0x00ff;
-    if (sum < last)
-        sum++;
-    return(sum);
-}
-
 // EOF
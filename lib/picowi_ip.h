@@ -85,11 +85,45 @@ typedef struct
 #define RARPREQ     0x0003  /*              RARP request */
 #define RARPRESP    0x0004  /*              RARP response */
 
+// ARP cache size and timing
+#ifndef NUM_ARP_ENTRIES
+#define NUM_ARP_ENTRIES     10
+#endif
+#ifndef ARP_TIMEOUT_USEC
+#define ARP_TIMEOUT_USEC    300000000   // Time before an entry expires
+#endif
+#ifndef ARP_REFRESH_USEC
+#define ARP_REFRESH_USEC    240000000   // Age at which an entry in use is refreshed
+#endif
+#define ARP_RETRY_USEC      1000000     // Time between requests
+#define ARP_TRIES           3           // Requests sent before giving up
+// Number of IP frames that can wait for address resolution
+#ifndef ARP_QUEUE_LEN
+#define ARP_QUEUE_LEN       4
+#endif
+
+// ARP cache entry states
+#define ARP_FREE            0
+#define ARP_PENDING         1   // Request sent, awaiting response
+#define ARP_VALID           2
+
 typedef struct {
     MACADDR mac;
     IPADDR  ipaddr;
+    BYTE    state;          // ARP_FREE, ARP_PENDING or ARP_VALID
+    BYTE    tries;          // Number of requests sent
+    BYTE    refresh;        // Non-zero if in use, and needs refreshing
+    uint32_t ticks;         // Time the entry was last confirmed
+    uint32_t req_ticks;     // Time of last request
+    uint32_t used_ticks;    // Time of last use, for replacement
 } ARP_ENTRY;
 
+// IP frame waiting for address resolution
+typedef struct {
+    BYTE *buff;             // Frame buffer from pool, null if none
+    int len;
+} ARP_QENTRY;
+
 /* ***** IP (Internet Protocol) header ***** */
 typedef struct
 {
@@ -161,6 +195,7 @@ typedef struct              /* Pseudo-header... */
 int ip_init(IPADDR addr);
 void ip_set_mac(BYTE *mac);
 int ip_tx_eth(BYTE *buff, int len);
+int ip_tx_eth2(BYTE *buff, int len, const BYTE *data, int dlen);
 int ip_add_eth(BYTE *buff, MACADDR dmac, MACADDR smac, WORD pcol);
 void ip_print_eth(BYTE *buff);
 int arp_event_handler(EVENT_INFO *eip);
@@ -169,10 +204,19 @@ int ip_make_arp(BYTE *buff, MACADDR mac, IPADDR addr, WORD op);
 int ip_tx_arp(MACADDR mac, IPADDR addr, WORD op);
 void ip_save_arp(MACADDR mac, IPADDR addr);
 bool ip_find_arp(IPADDR addr, MACADDR mac);
+int ip_arp_entry(IPADDR addr);
+int ip_arp_new_entry(IPADDR addr);
+int ip_arp_resolve(BYTE *buff, int len);
+void ip_arp_send_queued(IPADDR addr, bool ok);
+void ip_arp_poll(void);
+BYTE *ip_next_hop(IPADDR dip);
+bool ip_is_bcast(IPADDR dip);
 void ip_print_arp(ARPKT *arp);
 int ip_check_frame(BYTE *data, int dlen);
 int ip_check_ip(BYTE *data, int dlen);
 int ip_add_hdr(BYTE *buff, IPADDR dip, BYTE pcol, WORD dlen);
+void ip_make_tmpl(IPHDR *ip, IPADDR dip, BYTE pcol);
+int ip_add_hdr_tmpl(BYTE *buff, IPHDR *tmpl, WORD dlen);
 int icmp_event_handler(EVENT_INFO *eip);
 int ip_rx_icmp(BYTE *data, int dlen);
 int ip_add_icmp(BYTE *buff, BYTE type, BYTE code, void *data, WORD dlen);
@@ -189,6 +233,5 @@ void ip_cpy(BYTE *dest, BYTE *src);
 WORD htons(WORD w);
 WORD htonsp(BYTE *p);
 DWORD htonl(DWORD d);
-WORD add_csum(WORD sum, void *dp, int count);
 
 // EOF
@@ -39,8 +39,9 @@
 #define EVENT_POLL_USEC     100000
 
 extern int display_mode;
-NET_SOCKET net_sockets[NUM_NET_SOCKETS];
-extern int accept_socket;
+extern MACADDR my_mac;
+NET_SOCKET net_sockets[NUM_NET_SOCKETS] __attribute__((aligned(4)));
+BYTE net_hash[NET_HASH_SIZE];   // Socket number + 1, or 0 if slot is empty
 
 // Initialise the network stack
 int net_init(void)
@@ -48,9 +49,7 @@ int net_init(void)
     int ok = 0;
     
     add_event_handler(join_event_handler);
-    add_event_handler(arp_event_handler);
-    add_event_handler(dhcp_event_handler);
-    add_event_handler(udp_event_handler);
+    add_event_handler(net_event_handler);
     printf("PicoWi DHCP client\n");
     if (!wifi_setup())
         printf("Error: SPI communication\n");
@@ -61,6 +60,51 @@ int net_init(void)
     return (ok);
 }
 
+// Handler for incoming network frames; the Ethernet & IP headers are
+// checked once, then the frame is passed on by Ethernet protocol, IP protocol
+// and port number, so the time taken doesn't depend on the number of sockets
+int net_event_handler(EVENT_INFO *eip)
+{
+    ETHERHDR *ehp = (ETHERHDR *)eip->data;
+    IPHDR *ip = (IPHDR *)&eip->data[sizeof(ETHERHDR)];
+    UDPHDR *udp = (UDPHDR *)&eip->data[sizeof(ETHERHDR) + sizeof(IPHDR)];
+    int hlen = sizeof(ETHERHDR) + sizeof(IPHDR);
+
+    if (eip->chan != SDPCM_CHAN_DATA || eip->dlen < sizeof(ETHERHDR) + sizeof(ARPKT))
+        return (0);
+    switch (htons(ehp->ptype))
+    {
+    case PCOL_ARP:
+        if (MAC_IS_BCAST(ehp->dest) || MAC_CMP(ehp->dest, my_mac))
+            return (ip_rx_arp(eip->data, eip->dlen));
+        break;
+    case PCOL_IP:
+        if (!ip_check_frame(eip->data, eip->dlen))
+            break;
+        // Remove any padding after the IP data
+        eip->dlen = MIN(eip->dlen, sizeof(ETHERHDR) + htons(ip->len));
+        switch (ip->pcol)
+        {
+        case PICMP:
+            if (IP_CMP(ip->dip, my_ip) && eip->dlen > hlen + sizeof(ICMPHDR))
+                return (ip_rx_icmp(eip->data, eip->dlen));
+            break;
+        case PUDP:
+            if (eip->dlen > hlen + sizeof(UDPHDR) && udp->dport == htons(DHCP_CLIENT_PORT))
+                return (dhcp_rx(eip->data, eip->dlen));
+            if (eip->dlen >= hlen + sizeof(UDPHDR))
+                return (udp_rx(eip->data, eip->dlen));
+            break;
+        case PTCP:
+            if (IP_CMP(ip->dip, my_ip) && eip->dlen >= TCP_DATA_OFFSET)
+                return (tcp_rx(eip));
+            break;
+        }
+        break;
+    }
+    return (0);
+}
+
 // Join a network
 int net_join(char *ssid, char *passwd)
 {
@@ -86,6 +130,7 @@ int net_event_poll(void)
     {
         ret = event_poll();
         join_state_poll(0, 0);
+        ip_arp_poll();
         ustimeout(&poll_ticks, 0);
     }
     return (ret);
@@ -123,6 +168,43 @@ int setsockopt(int sock, int level, int optname, void *optval, socklen_t optlen)
             ustimeout(&usp->ticks, 0);
             ret = 0;
         }
+        else if (level == SOL_SOCKET && optname == SO_MAX_PACING_RATE &&
+            optlen == sizeof(uint32_t))
+        {
+            usp->pace_rate = *(uint32_t *)optval;
+            ret = 0;
+        }
+        else if (level == SOL_SOCKET && optname == SO_KEEPALIVE &&
+            optlen == sizeof(int))
+        {
+            usp->keep_off = *(int *)optval == 0;
+            ret = 0;
+        }
+        else if (level == IPPROTO_TCP && optlen == sizeof(int) &&
+            (optname == TCP_KEEPIDLE || optname == TCP_KEEPINTVL) &&
+            *(int *)optval > 0 && *(int *)optval <= TCP_KEEP_MAXSEC)
+        {
+            if (optname == TCP_KEEPIDLE)
+                usp->keep_idle = *(int *)optval * 1000000;
+            else
+                usp->keep_intvl = *(int *)optval * 1000000;
+            ret = 0;
+        }
+        else if (level == IPPROTO_TCP && optname == TCP_KEEPCNT &&
+            optlen == sizeof(int) && *(int *)optval > 0)
+        {
+            usp->keep_cnt = *(int *)optval;
+            ret = 0;
+        }
+        else if (level == IPPROTO_TCP && optlen == sizeof(int) &&
+            (optname == TCP_CORK || optname == TCP_NODELAY))
+        {
+            if (optname == TCP_CORK)
+                usp->cork = *(int *)optval != 0;
+            else
+                usp->nagle = *(int *)optval == 0;
+            ret = 0;
+        }
     }
     return (ret);
 }
@@ -136,13 +218,17 @@ char *inet_ntoa(struct in_addr  addr)
     return (temps);
 }
 
-// Open a new socket
+// Open a new socket; it is reserved for the application until closed
 int socket(int domain, int type, int protocol)
 {
     int sock = type==SOCK_DGRAM ? udp_sock_unused() : tcp_sock_unused();
     
-    memset(&net_sockets[sock], 0, sizeof(NET_SOCKET));
-    net_sockets[sock].sock_type = type;
+    if (sock >= 0)
+    {
+        memset(&net_sockets[sock], 0, sizeof(NET_SOCKET));
+        net_sockets[sock].sock_type = type;
+        net_sockets[sock].app_open = 1;
+    }
     return (sock);
 }
         
@@ -157,43 +243,55 @@ int bind(int sock, struct sockaddr *addr, socklen_t addrlen)
         if (net_sockets[sock].sock_type == SOCK_DGRAM)
             udp_sock_set(sock, 0, zero_ip, 0, htons(sinp->sin_port));
         else
-        {
-            add_server_event_handler(tcp_server_event_handler, htons(sinp->sin_port));
             tcp_sock_set(sock, 0, zero_ip, 0, htons(sinp->sin_port));
-        }
         ok = 1;
     }
     return (ok);
 }
 
-// Set TCP server sockets to accept incoming connections
+// Set TCP server socket to accept incoming connections
+// The backlog is the max number of connections awaiting accept(); until
+// the application calls accept() or poll(), connections aren't queued,
+// they are served by the Web page handlers
 int listen(int sock, int backlog)
 {
-    NET_SOCKET *tsp = &net_sockets[sock], *nsp;
-    
+    if (sock < 0 || sock >= NUM_NET_SOCKETS)
+        return (-1);
+    net_sockets[sock].backlog = MIN(MAX(backlog, 1), TCP_ACCEPTQ_LEN);
     tcp_new_state(sock, T_LISTEN);
-    while (backlog-- > 1 && (sock=tcp_sock_unused())>=0)
-    {
-        nsp = &net_sockets[sock];
-        *nsp++ = *tsp;
-    }
-    return (sock >= 0);
+    return (0);
 }
 
-// Return TCP socket number that has received data, -1 if none
+// Return TCP socket number of a new connection, -1 if none
 int accept(int server_sock, struct sockaddr *addr, socklen_t *addrlen)
 {
     struct sockaddr_in *sin = (struct sockaddr_in *)addr;
+    int sock = tcp_sock_accept(server_sock);
     NET_SOCKET *ssp;
     
-    if (accept_socket >= 0 && accept_socket < NUM_NET_SOCKETS)
+    if (sock >= 0 && sin)
     {
-        ssp = &net_sockets[accept_socket];
+        ssp = &net_sockets[sock];
         sin->sin_len = 4;
         sin->sin_port = htons(ssp->rem_port);
         IP_CPY((uint8_t *)&sin->sin_addr, ssp->rem_ip);
     }
-    return (accept_socket);
+    return (sock);
+}
+
+// Start a TCP connection to a server, return 0 if OK, -1 if error
+// This doesn't block; the socket state changes to T_ESTABLISHED when connected,
+// or to T_CLOSED if the connection fails, or is closed
+int connect(int sock, struct sockaddr *addr, socklen_t addrlen)
+{
+    struct sockaddr_in *sinp = (struct sockaddr_in *)addr;
+    int ok = -1;
+    
+    if (sock >= 0 && sock < NUM_NET_SOCKETS && 
+        net_sockets[sock].sock_type == SOCK_STREAM &&
+        tcp_sock_connect(sock, (BYTE *)&sinp->sin_addr, htons(sinp->sin_port)))
+        ok = 0;
+    return (ok);
 }
 
 // Receive from a UDP datagram, return the data and IP address
@@ -232,10 +330,154 @@ int sendto(int sock, void *data, size_t size, int flags, struct sockaddr *to, so
     return (0);
 }
 
+// Send data on a TCP socket, without blocking; it is copied to the socket's
+// Tx ring, which the stack empties as the remote window allows
+// Return the number of bytes accepted, -1 if none
+int send(int sock, const void *data, size_t len, int flags)
+{
+    NET_SOCKET *ts = &net_sockets[sock];
+    int n = 0;
+    
+    if (sock >= 0 && sock < NUM_NET_SOCKETS && ts->sock_type == SOCK_STREAM &&
+        !ts->close && tcp_sock_ring(sock))
+        n = tcp_sock_ring_put(sock, data, len);
+    return (n > 0 ? n : -1);
+}
+
+// Receive data from a TCP socket, without blocking
+// Return the byte count, 0 if the connection is closed, -1 if no data yet
+int recv(int sock, void *mem, size_t len, int flags)
+{
+    NET_SOCKET *ts = &net_sockets[sock];
+    int n = -1;
+    
+    if (sock >= 0 && sock < NUM_NET_SOCKETS && ts->sock_type == SOCK_STREAM)
+    {
+        if (tcp_sock_ring(sock))
+            n = tcp_sock_ring_get(sock, mem, len);
+        if (n <= 0)
+            n = tcp_sock_rx_open(sock) ? -1 : 0;
+    }
+    return (n);
+}
+
+// Wait for events on sockets, with timeout in msec (-ve to wait forever)
+// Return the number of sockets with events
+int poll(struct pollfd *fds, nfds_t nfds, int timeout)
+{
+    uint32_t ticks;
+    int i, n;
+    
+    ustimeout(&ticks, 0);
+    while (1)
+    {
+        for (i = n = 0; i < nfds; i++)
+        {
+            fds[i].revents = net_sock_events(fds[i].fd) & 
+                (fds[i].events | POLLERR | POLLHUP | POLLNVAL);
+            n += fds[i].revents != 0;
+        }
+        if (n > 0 || timeout == 0 || (timeout > 0 && ustimeout(&ticks, timeout * 1000)))
+            break;
+        net_event_poll();
+        net_state_poll();
+        tcp_socks_poll();
+    }
+    return (n);
+}
+
+// Return the poll events for a socket; a -ve socket number is ignored
+int net_sock_events(int sock)
+{
+    NET_SOCKET *usp = &net_sockets[sock];
+    
+    if (sock < 0)
+        return (0);
+    if (sock >= NUM_NET_SOCKETS)
+        return (POLLNVAL);
+    if (usp->sock_type == SOCK_STREAM)
+        return (tcp_sock_events(sock));
+    return (POLLOUT | (usp->rxlen >= UDP_DATA_OFFSET ? POLLIN : 0));
+}
+
 // Return pointer to net socket structure, given socket number
 NET_SOCKET *net_socket_ptr(int sock)
 {
     return(&net_sockets[sock]);
 }
 
+// Return hash table slot for socket address
+// TCP sockets use remote IP & port, UDP sockets (and listening TCP
+// sockets) are only matched on local port, so the remote values are zero
+int net_hash_slot(IPADDR remip, WORD remport, WORD locport)
+{
+    DWORD h = ((DWORD)remip[0] << 24) | ((DWORD)remip[1] << 16) |
+              ((DWORD)remip[2] << 8) | remip[3];
+
+    h = (h ^ ((DWORD)remport << 16) ^ locport) * 0x9E3779B1;
+    return (h >> (32 - NET_HASH_BITS));
+}
+
+// Add socket to hash table, using its current address
+void net_hash_add(int sock)
+{
+    NET_SOCKET *sp = &net_sockets[sock];
+    int n;
+
+    n = sp->sock_type == SOCK_STREAM ?
+        net_hash_slot(sp->rem_ip, sp->rem_port, sp->loc_port) :
+        net_hash_slot(zero_ip, 0, sp->loc_port);
+    while (net_hash[n])
+        n = (n + 1) & (NET_HASH_SIZE - 1);
+    net_hash[n] = (BYTE)(sock + 1);
+}
+
+// Update hash table after socket address has changed
+// Remove the old entry, re-insert the rest of its probe sequence so it
+// isn't broken by the empty slot, then add the new entry if socket in use
+void net_sock_hash(int sock)
+{
+    int i, n, e;
+
+    for (i = 0; i < NET_HASH_SIZE && net_hash[i] != sock + 1; i++) ;
+    if (i < NET_HASH_SIZE)
+    {
+        net_hash[i] = 0;
+        n = (i + 1) & (NET_HASH_SIZE - 1);
+        while ((e = net_hash[n]) != 0)
+        {
+            net_hash[n] = 0;
+            net_hash_add(e - 1);
+            n = (n + 1) & (NET_HASH_SIZE - 1);
+        }
+    }
+    if (net_sockets[sock].loc_port)
+        net_hash_add(sock);
+}
+
+// Find socket matching address, return -ve if none
+// A zero remote port gives a TCP listening socket
+// UDP sockets are only matched on local port
+int net_sock_find(int type, IPADDR remip, WORD remport, WORD locport)
+{
+    NET_SOCKET *sp;
+    int n, e;
+
+    n = type == SOCK_STREAM ? net_hash_slot(remip, remport, locport) :
+        net_hash_slot(zero_ip, 0, locport);
+    while ((e = net_hash[n]) != 0)
+    {
+        sp = &net_sockets[e - 1];
+        if (sp->loc_port == locport)
+        {
+            if (type == SOCK_STREAM ? (sp->sock_type == SOCK_STREAM &&
+                remport == sp->rem_port && IP_CMP(remip, sp->rem_ip)) :
+                sp->sock_type != SOCK_STREAM)
+                return (e - 1);
+        }
+        n = (n + 1) & (NET_HASH_SIZE - 1);
+    }
+    return (-1);
+}
+
 // EOF
@@ -27,11 +27,83 @@ extern int dhcp_complete;
 #define INADDR_ANY      0
 #define SOL_SOCKET      0xFFF
 #define SO_RCVTIMEO     0
+#define SO_KEEPALIVE    9       // Option to enable or disable keepalive probes
+#define IPPROTO_TCP     6
+#define TCP_NODELAY     1       // Option to disable Nagle algorithm
+#define TCP_CORK        3       // Option to hold back partial segments
+#define TCP_KEEPIDLE    4       // Idle seconds before first keepalive probe
+#define TCP_KEEPINTVL   5       // Seconds between keepalive probes
+#define TCP_KEEPCNT     6       // Unanswered probes before connection is reset
+#define SO_MAX_PACING_RATE 47   // Option to limit Tx rate, in bytes/sec
 
 #define SOCK_STREAM     1
 #define SOCK_DGRAM      2
 
-#define NUM_NET_SOCKETS 5
+// Number of sockets; frame buffers are allocated from a pool when needed,
+// but each socket still has its TCP state & queue entries: about 630 bytes
+// on the Pico, including its TCP statistics & header template
+#ifndef NUM_NET_SOCKETS
+#define NUM_NET_SOCKETS 16
+#endif
+// Socket lookup hash table, must be a power of 2, and at least twice the
+// number of sockets, so the open-addressed probe sequences stay short
+#ifndef NET_HASH_BITS
+#define NET_HASH_BITS   5
+#endif
+#define NET_HASH_SIZE   (1 << NET_HASH_BITS)
+#if NET_HASH_SIZE < NUM_NET_SOCKETS * 2
+#error "NET_HASH_BITS too small for NUM_NET_SOCKETS"
+#endif
+#define TCP_TXQ_SEGS    4       // Max number of unacknowledged TCP segments
+#define TCP_RXQ_SEGS    4       // Max number of out-of-sequence TCP segments
+#ifndef TCP_ACCEPTQ_LEN
+#define TCP_ACCEPTQ_LEN 4       // Max connections awaiting accept(), per listener
+#endif
+
+// Function called when referenced Tx data has been acknowledged
+typedef void(*tx_release_t)(int sock, const BYTE *data, int dlen);
+
+// TCP segment in transmit queue, awaiting acknowledgement
+// The data is in the frame buffer after the headers, followed by any
+// data that is referenced in the application's memory, so isn't copied
+typedef struct {
+    DWORD seq;
+    int dlen;
+    BYTE flags;
+    BYTE sacked;            // Non-zero if segment covered by SACK block
+    BYTE resent;            // Non-zero if segment resent in fast recovery
+    BYTE pending;           // Non-zero if awaiting resend after timeout
+    BYTE *frame;            // Frame buffer from pool, null if none
+    const BYTE *ref;        // Referenced data, null if none
+    int reflen;
+    tx_release_t release;   // Function to release referenced data
+    DWORD csum;             // Checksum of the data, for each transmission
+} TCP_TXSEG;
+
+// Out-of-sequence TCP segment, awaiting reassembly
+typedef struct {
+    DWORD seq;
+    int len;
+    BYTE *data;             // Data buffer from pool
+} TCP_RXSEG;
+
+// Ring buffers for a TCP socket that uses send() and recv(), allocated
+// when first used; the size must be a power of 2
+// None by default, to save RAM; applications using send() and recv()
+// link a library built with NUM_TCP_RINGS set, see CMakeLists.txt
+#ifndef NUM_TCP_RINGS
+#define NUM_TCP_RINGS   0
+#endif
+#ifndef TCP_RING_SIZE
+#define TCP_RING_SIZE   8192
+#endif
+typedef struct {
+    int used;
+    DWORD tx_in, tx_sent, tx_out;   // Tx counts added, sent, acknowledged
+    DWORD rx_in, rx_out;            // Rx counts received, read
+    BYTE txd[TCP_RING_SIZE];
+    BYTE rxd[TCP_RING_SIZE];
+} TCP_RING;
 
 typedef int(*web_handler_t)(int sock, char *req, int oset);
 
@@ -43,13 +115,54 @@ struct net_socket_t
     MACADDR rem_mac;
     BYTE padding[2];
     BYTE *rxdata;
-    int rxlen, rxdlen, txdlen, tries, close, errors;
+    int rxlen, rxdlen, txdlen, tries, close, errors, client;
     uint32_t ticks, timeout;
     int sock_type, state;
     DWORD seq, ack, rx_seq, rx_ack, start_seq, last_rx_ack;
     int(*sock_handler)(struct net_socket_t *usp);
     web_handler_t web_handler;
-    BYTE txbuff[MAXFRAME];
+    TCP_RING *ring;         // Ring buffers for send() and recv(), null if none
+    int txq_out, txq_count;
+    uint32_t rtx_ticks;
+    int ack_pending;        // Number of received segments not yet ACKed
+    uint32_t ack_ticks;
+    int cork, nagle;        // Modes to combine small writes into segments
+    uint32_t cork_ticks;
+    uint32_t srtt, rttvar, rto, rtt_ticks;
+    DWORD rtt_seq;
+    int rtt_timing;
+    int dup_acks;
+    DWORD recover, sack_seq;
+    DWORD rx_read;          // Sequence number of next Rx byte for application
+    DWORD fin_seq;          // Sequence number of remote FIN, if fin_rx is set
+    int fin_rx;             // Non-zero if FIN received, may be awaiting data
+    DWORD rx_win, rx_win_sent, last_rx_win;
+    BYTE sack_ok, fast_recovery, wscale_ok, wscale_tx;
+    int mss;                // Max data in Tx segment, given remote MSS & options
+    int ts_ok;              // Non-zero if timestamps are in use
+    DWORD ts_recent;        // Remote timestamp, to be echoed
+    DWORD ts_recent_age;    // Time when remote timestamp was saved, in msec
+    DWORD rx_tsecr;         // Timestamp echoed in Rx segment, 0 if none
+    DWORD cwnd, ssthresh;   // Congestion window, slow start threshold
+    DWORD cwnd_acked;       // Bytes acked towards congestion avoidance increase
+    DWORD pace_rate;        // Max Tx rate in bytes/sec, 0 if not paced
+    uint32_t pace_ticks, pace_usec;
+    int keep_off;           // Non-zero if keepalive probes are disabled
+    uint32_t keep_idle, keep_intvl; // Keepalive times in usec, 0 if default
+    int keep_cnt;           // Keepalive probe count, 0 if default
+    uint32_t keep_ticks;    // Time of last Rx segment or keepalive probe
+    int keep_probes;        // Number of unanswered keepalive probes
+    uint32_t persist_ticks; // Time of last window probe
+    uint32_t persist_usec;  // Time between window probes, 0 if not probing
+    int parent;             // Listening socket + 1, if connection created by it
+    int app_open;           // Non-zero if opened by socket() or accept(), until closed
+    int backlog;            // Max connections awaiting accept(), if listening
+    int accepting;          // Non-zero if application has called accept() or poll()
+    int acceptq_count;
+    BYTE acceptq[TCP_ACCEPTQ_LEN];  // Connections awaiting accept()
+    TCP_TXSEG txq[TCP_TXQ_SEGS];
+    int rxq_count;
+    TCP_RXSEG rxq[TCP_RXQ_SEGS];
 };
 typedef struct net_socket_t NET_SOCKET;
 typedef int(*net_handler_t)(struct net_socket_t *usp);
@@ -76,7 +189,23 @@ struct sockaddr {
 };
 #pragma pack()
 
+// Socket events for poll()
+#define POLLIN          0x01    // Data can be read, or connection closed
+#define POLLOUT         0x04    // Data can be sent
+#define POLLERR         0x08
+#define POLLHUP         0x10    // Connection is closed
+#define POLLNVAL        0x20    // Invalid socket
+
+typedef unsigned int nfds_t;
+
+struct pollfd {
+    int             fd;
+    short           events;
+    short           revents;
+};
+
 int net_init(void);
+int net_event_handler(EVENT_INFO *eip);
 int net_join(char *ssid, char *passwd);
 int net_event_poll(void);
 void net_state_poll(void);
@@ -86,8 +215,17 @@ int socket(int domain, int type, int protocol);
 int bind(int sock, struct sockaddr *addr, socklen_t addrlen);
 int listen(int sock, int backlog);
 int accept(int server_sock, struct sockaddr *addr, socklen_t *addrlen);
+int connect(int sock, struct sockaddr *addr, socklen_t addrlen);
 int recvfrom(int sock, void *mem, size_t len, int flags, struct sockaddr *from, socklen_t *fromlen);
 int sendto(int sock, void *data, size_t size, int flags, struct sockaddr *to, socklen_t tolen);
+int send(int sock, const void *data, size_t len, int flags);
+int recv(int sock, void *mem, size_t len, int flags);
+int poll(struct pollfd *fds, nfds_t nfds, int timeout);
+int net_sock_events(int sock);
 NET_SOCKET *net_socket_ptr(int sock);
+int net_hash_slot(IPADDR remip, WORD remport, WORD locport);
+void net_hash_add(int sock);
+void net_sock_hash(int sock);
+int net_sock_find(int type, IPADDR remip, WORD remport, WORD locport);
 
 // EOF
@@ -22,6 +22,7 @@
 
 #include <stdio.h>
 #include <string.h>
+#include <stddef.h>
 
 #include "picowi_defs.h"
 #include "picowi_pico.h"
@@ -31,6 +32,8 @@
 #include "picowi_net.h"
 #include "picowi_tcp.h"
 #include "picowi_web.h"
+#include "picowi_buff.h"
+#include "picowi_csum.h"
 
 extern int display_mode;
 
@@ -44,7 +47,18 @@ char *tcflags[] =               // Text for TCP option flags
 char *tstate_strings[] = { TCP_STATE_STRS };
 
 extern NET_SOCKET net_sockets[NUM_NET_SOCKETS];
-int accept_socket = -1;
+BYTE tcp_active[TCP_NUM_SOCKETS];   // Sockets with timers that need polling
+int tcp_nactive;
+#if NUM_TCP_RINGS > 0
+TCP_RING tcp_rings[NUM_TCP_RINGS];  // Ring buffers for send() and recv()
+#endif
+TCP_SYNREQ tcp_synq[TCP_SYNQ_LEN];  // Half-open connections
+TCP_TIMEWAIT tcp_timewaits[TCP_TIMEWAIT_LEN];   // Closed connections
+TCP_STATS tcp_stats[NUM_NET_SOCKETS];   // Statistics for each socket
+TCP_STATS tcp_stats_total;              // Total for connections that have ended
+TCP_HDR_TMPL tcp_tmpls[NUM_NET_SOCKETS];// Header template for each socket
+// MSS values that can be encoded in a SYN cookie
+const WORD tcp_cookie_mss[4] = {TCP_MSS_DEFAULT, 1024, 1360, TCP_TX_MAXDATA};
 
 int web_page_rx(int sock, char *req, int len);
 
@@ -58,7 +72,8 @@ int tcp_sock_unused(void)
 {
     for (int i = 0; i < NUM_NET_SOCKETS; i++)
     {
-        if (net_sockets[i].loc_port == 0 && net_sockets[i].rem_port == 0)
+        if (net_sockets[i].loc_port == 0 && net_sockets[i].rem_port == 0 &&
+            !net_sockets[i].app_open)
             return (i);
     }
     return (-1);
@@ -74,15 +89,14 @@ void tcp_sock_set(int sock, net_handler_t handler, IPADDR remip, WORD remport, W
     tsp->loc_port = locport;
     tsp->rem_port = remport;
     tsp->sock_handler = handler;
+    net_sock_hash(sock);
 }
 
-// Handler for incoming TCP segment
+// Handler for incoming TCP segment, to a server port
 int tcp_server_event_handler(EVENT_INFO *eip)
 {
-    ETHERHDR *ehp = (ETHERHDR *)eip->data;
     IPHDR *ip = (IPHDR *)&eip->data[sizeof(ETHERHDR)];
     TCPHDR *tcp = (TCPHDR *)&eip->data[sizeof(ETHERHDR) + sizeof(IPHDR)];
-    int sock, iplen = htons(ip->len);
 
     if (eip->chan == SDPCM_CHAN_DATA &&
         ip->pcol == PTCP &&
@@ -91,80 +105,453 @@ int tcp_server_event_handler(EVENT_INFO *eip)
         eip->dlen >= TCP_DATA_OFFSET &&
         htons(tcp->dport) == eip->server_port)
     {
-        eip->dlen = MIN(eip->dlen, sizeof(ETHERHDR) + iplen);
-        sock = tcp_sock_match(ip->sip, htons(tcp->sport), htons(tcp->dport), tcp->flags);
-        if (display_mode & DISP_TCP)
+        eip->dlen = MIN(eip->dlen, sizeof(ETHERHDR) + htons(ip->len));
+        return (tcp_rx(eip));
+    }
+    return(0);
+}
+
+// Receive TCP segment, that has been checked, pass it to the matching socket
+// If there is no socket, or it is in TIME_WAIT, respond with reset or ACK
+int tcp_rx(EVENT_INFO *eip)
+{
+    ETHERHDR *ehp = (ETHERHDR *)eip->data;
+    IPHDR *ip = (IPHDR *)&eip->data[sizeof(ETHERHDR)];
+    TCPHDR *tcp = (TCPHDR *)&eip->data[sizeof(ETHERHDR) + sizeof(IPHDR)];
+    int sock = tcp_sock_match(ip->sip, htons(tcp->sport), htons(tcp->dport));
+
+    if (display_mode & DISP_TCP)
+    {
+        if (sock >= 0)
+            printf("Rx%d ", sock);
+        else
+            printf("Rx  ");
+        tcp_print_hdr(sock, eip->data, eip->dlen);
+    }
+    if ((sock < 0 || net_sockets[sock].state == T_LISTEN) && tcp_timewait_rx(eip->data))
+        return (1);
+    if (sock >= 0)
+    {
+        eip->sock = sock;
+        return (tcp_sock_rx(sock, eip->data, eip->dlen));
+    }
+    else if (!(tcp->flags & TCP_RST))
+    {
+        tcp_send_reset(sock, ehp->srce, ip->sip, htons(tcp->sport), htons(tcp->dport),
+            htonl(tcp->ack), htonl(tcp->seq) + (tcp->flags&TCP_SYN ? 1 : 0));
+    }
+    return(1);
+}
+
+// Start a TCP client connection, return 0 if no port available
+int tcp_sock_connect(int sock, IPADDR remip, WORD remport)
+{
+    NET_SOCKET *ts = &net_sockets[sock];
+    WORD locport = tcp_ephem_port();
+
+    if (!locport)
+        return (0);
+    tcp_sock_set(sock, 0, remip, remport, locport);
+    ts->client = 1;
+    ts->seq = ustime();
+    ts->start_seq = ts->seq + 1;
+    ts->seq++;
+    tcp_new_state(sock, T_SYN_SENT);
+    tcp_sock_syn(sock);
+    return (1);
+}
+
+// Send SYN to remote server, or ARP request if its MAC address is unknown
+void tcp_sock_syn(int sock)
+{
+    NET_SOCKET *ts = &net_sockets[sock];
+
+    if (MAC_IS_NONZERO(ts->rem_mac) || ip_find_arp(ip_next_hop(ts->rem_ip), ts->rem_mac))
+    {
+        ts->seq--;
+        tcp_sock_send(sock, TCP_SYN, 0, 0);
+        ts->seq++;
+        if (ts->tries == 0)
+            tcp_sock_rtt_start(sock, ts->seq);
+    }
+    else
+    {
+        ip_tx_arp(ts->rem_mac, ip_next_hop(ts->rem_ip), ARPREQ);
+        ts->ticks = ustime();
+    }
+}
+
+// Return an unused ephemeral port number, 0 if none
+WORD tcp_ephem_port(void)
+{
+    static WORD port = 0;
+    int i, n;
+
+    for (n = 0; n <= NUM_NET_SOCKETS; n++)
+    {
+        port = port < TCP_EPHEM_MIN || port == 0xffff ?
+            TCP_EPHEM_MIN + (ustime() & 0x3fff) : port + 1;
+        for (i = 0; i < NUM_NET_SOCKETS && net_sockets[i].loc_port != port; i++) ;
+        if (i >= NUM_NET_SOCKETS)
+            return (port);
+    }
+    return (0);
+}
+
+// Set the handler for a client socket, that supplies Tx data and gets Rx data
+void tcp_sock_set_handler(int sock, web_handler_t handler)
+{
+    net_sockets[sock].web_handler = handler;
+}
+
+// Find matching socket for incoming TCP segment, return -ve if none
+// A segment that doesn't match a connection is given to a listening socket,
+// as it may be for a half-open connection in the SYN queue
+int tcp_sock_match(IPADDR remip, WORD remport, WORD locport)
+{
+    int sock = net_sock_find(SOCK_STREAM, remip, remport, locport);
+
+    if (sock < 0 && (sock = net_sock_find(SOCK_STREAM, zero_ip, 0, locport)) >= 0 &&
+        net_sockets[sock].state != T_LISTEN)
+        sock = -1;
+    return (sock);
+}
+
+// Handle incoming segment for a listening socket; the options in a SYN
+// have already been decoded into the socket
+// A SYN is put in the SYN queue, or if that is full, answered with a
+// SYN cookie; the ACK of the SYN ACK creates a connection socket
+int tcp_listen_rx(int sock, BYTE *data, int len)
+{
+    NET_SOCKET *ts = &net_sockets[sock];
+    ETHERHDR *ehp = (ETHERHDR *)data;
+    IPHDR *ip = (IPHDR *)&data[sizeof(ETHERHDR)];
+    TCPHDR *tcp = (TCPHDR *)&data[IP_DATA_OFFSET];
+    WORD remport = htons(tcp->sport), locport = htons(tcp->dport);
+    TCP_SYNREQ *req = tcp_synq_find(ip->sip, remport, locport), creq;
+    DWORD t = ustime() >> TCP_COOKIE_USHIFT;
+    int i, n;
+
+    if (tcp->flags & TCP_RST)
+    {
+        if (req)
+            req->loc_port = 0;
+    }
+    else if (tcp->flags & TCP_SYN)
+    {
+        // Resend SYN ACK if the SYN is repeated, or get a free queue entry
+        if (req && req->irs == ts->rx_seq)
         {
-            if (sock >= 0)
-                printf("Rx%d ", sock);
-            else
-                printf("Rx  ");
-            tcp_print_hdr(sock, eip->data, eip->dlen);
+            tcp_synq_send(sock, req);
+            return (1);
         }
-        if (sock >= 0)
+        for (i = 0; !req && i < TCP_SYNQ_LEN; i++)
+            req = tcp_synq[i].loc_port ? 0 : &tcp_synq[i];
+        if (!req)
+            memset(req = &creq, 0, sizeof(creq));
+        MAC_CPY(req->rem_mac, ehp->srce);
+        IP_CPY(req->rem_ip, ip->sip);
+        req->rem_port = remport;
+        req->loc_port = locport;
+        req->irs = ts->rx_seq;
+        req->tries = 0;
+        // SYN cookie has no space for the options, except the MSS
+        if (req == &creq)
         {
-            eip->sock = sock;
-            return (tcp_sock_rx(sock, eip->data, eip->dlen));
+            for (n = 3; n > 0 && tcp_cookie_mss[n] > ts->mss; n--) ;
+            req->mss = tcp_cookie_mss[n];
+            req->iss = tcp_syn_cookie(ip->sip, remport, locport, req->irs, t, n);
         }
-        else if (!(tcp->flags & TCP_RST))
+        else
         {
-            tcp_send_reset(sock, ehp->srce, ip->sip, htons(tcp->sport), htons(tcp->dport),
-                htonl(tcp->ack), htonl(tcp->seq) + (tcp->flags&TCP_SYN ? 1 : 0));
+            req->iss = ustime();
+            req->mss = ts->mss;
+            req->sack_ok = ts->sack_ok;
+            req->wscale_ok = ts->wscale_ok;
+            req->wscale_tx = ts->wscale_tx;
+            req->ts_ok = ts->ts_ok;
+            req->ts_recent = ts->ts_recent;
         }
-        return(1);
+        tcp_synq_send(sock, req);
     }
-    return(0);
+    // ACK of SYN ACK: create connection socket, and give it the segment,
+    // as there may be data; if there is no socket, discard the ACK
+    else if ((tcp->flags & TCP_ACK) && ((req && ts->rx_ack == req->iss + 1) ||
+             (!req && tcp_syn_cookie_check(sock, req = &creq))))
+    {
+        if ((n = tcp_sock_new_conn(sock, req)) >= 0)
+        {
+            req->loc_port = 0;
+            return (tcp_sock_rx(n, data, len));
+        }
+    }
+    else
+        tcp_send_reset(-1, ehp->srce, ip->sip, remport, locport, ts->rx_ack, ts->rx_seq);
+    return (1);
 }
 
-// Find matching socket for incoming TCP segment, return -ve if none
-int tcp_sock_match(IPADDR remip, WORD remport, WORD locport, BYTE flags)
+// Find half-open connection in SYN queue, return null if none
+TCP_SYNREQ *tcp_synq_find(IPADDR remip, WORD remport, WORD locport)
+{
+    TCP_SYNREQ *req = tcp_synq;
+    
+    for (int i = 0; i < TCP_SYNQ_LEN; i++, req++)
+    {
+        if (req->loc_port == locport && req->rem_port == remport && IP_CMP(req->rem_ip, remip))
+            return (req);
+    }
+    return (0);
+}
+
+// Send SYN ACK for a half-open connection; the listening socket holds
+// the options to be sent
+void tcp_synq_send(int sock, TCP_SYNREQ *req)
+{
+    NET_SOCKET *ts = &net_sockets[sock];
+
+    ts->sack_ok = req->sack_ok;
+    ts->wscale_ok = req->wscale_ok;
+    ts->ts_ok = req->ts_ok;
+    ts->ts_recent = req->ts_recent;
+    req->ticks = ustime();
+    tcp_tx(sock, txbuff, req->rem_mac, req->rem_ip, req->rem_port, req->loc_port,
+        req->iss, req->irs + 1, TCP_SYN + TCP_ACK, 0, 0);
+}
+
+// Resend SYN ACKs that haven't been acknowledged, with backoff, and remove
+// half-open connections that have had too many tries
+void tcp_synq_poll(void)
+{
+    TCP_SYNREQ *req = tcp_synq;
+    int sock;
+    
+    for (int i = 0; i < TCP_SYNQ_LEN; i++, req++)
+    {
+        if (req->loc_port && ustime() - req->ticks >= (uint32_t)TCP_RTO_INIT << req->tries)
+        {
+            if (++req->tries >= TCP_TRIES ||
+                (sock = net_sock_find(SOCK_STREAM, zero_ip, 0, req->loc_port)) < 0 ||
+                net_sockets[sock].state != T_LISTEN)
+                req->loc_port = 0;
+            else
+                tcp_synq_send(sock, req);
+        }
+    }
+}
+
+// Make a SYN cookie, that is used as the initial sequence number (RFC 4987)
+// The top bits are a time count, then an MSS index, then a hash of the
+// connection, with a secret value so it can't be predicted
+DWORD tcp_syn_cookie(IPADDR remip, WORD remport, WORD locport, DWORD irs, DWORD t, int idx)
 {
-    NET_SOCKET *ts = 0;
+    static DWORD secret = 0;
+    DWORD h;
+
+    if (!secret)
+        secret = ustime() | 1;
+    t &= 0x1f;
+    h = (secret ^ irs ^ (t << 8) ^ idx) * 0x9E3779B1;
+    h = (h ^ (((DWORD)remip[0] << 24) | ((DWORD)remip[1] << 16) |
+              ((DWORD)remip[2] << 8) | remip[3])) * 0x9E3779B1;
+    h = (h ^ ((DWORD)remport << 16) ^ locport) * 0x9E3779B1;
+    return ((t << 27) | ((DWORD)idx << 24) | ((h ^ (h >> 13)) & 0xffffff));
+}
+
+// Check if an ACK is for a SYN cookie sent recently; if so, recreate
+// the half-open connection, and return non-zero
+int tcp_syn_cookie_check(int sock, TCP_SYNREQ *req)
+{
+    NET_SOCKET *ts = &net_sockets[sock];
+    ETHERHDR *ehp = (ETHERHDR *)ts->rxdata;
+    IPHDR *ip = (IPHDR *)&ts->rxdata[sizeof(ETHERHDR)];
+    TCPHDR *tcp = (TCPHDR *)&ts->rxdata[IP_DATA_OFFSET];
+    DWORD cookie = ts->rx_ack - 1, t = cookie >> 27, idx = (cookie >> 24) & 7;
+    
+    if (idx > 3 || (((ustime() >> TCP_COOKIE_USHIFT) - t) & 0x1f) > 1 ||
+        tcp_syn_cookie(ip->sip, htons(tcp->sport), htons(tcp->dport),
+            ts->rx_seq - 1, t, idx) != cookie)
+        return (0);
+    memset(req, 0, sizeof(TCP_SYNREQ));
+    MAC_CPY(req->rem_mac, ehp->srce);
+    IP_CPY(req->rem_ip, ip->sip);
+    req->rem_port = htons(tcp->sport);
+    req->loc_port = htons(tcp->dport);
+    req->iss = cookie;
+    req->irs = ts->rx_seq - 1;
+    req->mss = tcp_cookie_mss[idx];
+    req->tries = 1;
+    return (1);
+}
+
+// Create a connection socket when the handshake is complete; it has the
+// same options as the listening socket
+// If the application takes connections with accept(), it is put in the
+// accept queue, otherwise it is served by the Web page handlers, and isn't
+// limited by the backlog
+// Return -ve if no free socket, or the queue is full
+int tcp_sock_new_conn(int lsock, TCP_SYNREQ *req)
+{
+    NET_SOCKET *ls = &net_sockets[lsock], *ts;
+    int sock;
+
+    if ((ls->accepting && ls->acceptq_count >= ls->backlog) ||
+        (sock = tcp_sock_unused()) < 0)
+        return (-1);
+    ts = &net_sockets[sock];
+    memset(ts, 0, sizeof(NET_SOCKET));
+    ts->sock_type = SOCK_STREAM;
+    ts->web_handler = ls->web_handler;
+    ts->timeout = ls->timeout;
+    ts->cork = ls->cork;
+    ts->nagle = ls->nagle;
+    ts->pace_rate = ls->pace_rate;
+    ts->keep_off = ls->keep_off;
+    ts->keep_idle = ls->keep_idle;
+    ts->keep_intvl = ls->keep_intvl;
+    ts->keep_cnt = ls->keep_cnt;
+    ts->parent = lsock + 1;
+    MAC_CPY(ts->rem_mac, req->rem_mac);
+    tcp_sock_set(sock, ls->sock_handler, req->rem_ip, req->rem_port, req->loc_port);
+    ts->seq = ts->start_seq = ts->last_rx_ack = req->iss + 1;
+    ts->ack = ts->rx_read = req->irs + 1;
+    ts->mss = req->mss;
+    ts->sack_ok = req->sack_ok;
+    ts->wscale_ok = req->wscale_ok;
+    ts->wscale_tx = req->wscale_tx;
+    ts->ts_ok = req->ts_ok;
+    ts->ts_recent = req->ts_recent;
+    ts->ts_recent_age = tcp_ts_clock();
+    tcp_sock_cwnd_init(sock);
+    if (req->tries == 0)
+        tcp_sock_rtt_update(sock, ustime() - req->ticks);
+    tcp_new_state(sock, T_ESTABLISHED);
+    if (ls->accepting)
+        ls->acceptq[ls->acceptq_count++] = (BYTE)sock;
+    return (sock);
+}
+
+// Take the oldest connection from the accept queue, return -ve if none
+// Later connections are queued for accept(), not given to Web handlers
+int tcp_sock_accept(int lsock)
+{
+    NET_SOCKET *ls = &net_sockets[lsock];
+    int sock;
+
+    ls->accepting = 1;
+    if (ls->state != T_LISTEN || ls->acceptq_count == 0)
+        return (-1);
+    sock = ls->acceptq[0];
+    tcp_sock_unqueue(sock);
+    net_sockets[sock].app_open = 1;
+    return (sock);
+}
+
+// Remove connection from the accept queue of its listening socket
+void tcp_sock_unqueue(int sock)
+{
+    NET_SOCKET *ls;
     int i;
 
-    for (i=0; i<TCP_NUM_SOCKETS; i++)
+    if (net_sockets[sock].parent)
     {
-        ts = &net_sockets[i];
-        if (flags & TCP_SYN)
+        ls = &net_sockets[net_sockets[sock].parent - 1];
+        for (i = 0; i < ls->acceptq_count && ls->acceptq[i] != sock; i++) ;
+        if (i < ls->acceptq_count)
         {
-            if (locport == ts->loc_port && (
-                (ts->rem_port == 0 && ts->state == T_LISTEN) ||
-                (remport == ts->rem_port && IP_CMP(remip, ts->rem_ip))))
-                return (i);
+            memmove(&ls->acceptq[i], &ls->acceptq[i + 1], ls->acceptq_count - i - 1);
+            ls->acceptq_count--;
         }
-        else if (locport == ts->loc_port &&
-            remport == ts->rem_port &&
-            IP_CMP(remip, ts->rem_ip))
-            return(i);
     }
-    return (-1);
 }
 
-// Poll TCP sockets for timeout
-void tcp_socks_poll(void)
+// Add a socket's connection to the TIME_WAIT table, replacing the
+// oldest entry if the table is full
+void tcp_timewait_add(int sock)
+{
+    NET_SOCKET *ts = &net_sockets[sock];
+    TCP_TIMEWAIT *tw = tcp_timewaits, *old = tw;
+    
+    for (int i = 0; i < TCP_TIMEWAIT_LEN && tw->loc_port; i++, tw++)
+    {
+        if (ustime() - tw->ticks >= TCP_TIMEWAIT_USEC)
+            break;
+        if ((int)(tw->ticks - old->ticks) < 0)
+            old = tw;
+    }
+    if (tw >= &tcp_timewaits[TCP_TIMEWAIT_LEN])
+        tw = old;
+    IP_CPY(tw->rem_ip, ts->rem_ip);
+    tw->rem_port = ts->rem_port;
+    tw->loc_port = ts->loc_port;
+    tw->seq = ts->seq;
+    tw->ack = ts->ack;
+    tw->ticks = ustime();
+}
+
+// Handle incoming segment for a connection in TIME_WAIT, return 0 if none
+// A reset is ignored (RFC 1337), and a new SYN beyond the old sequence ends
+// TIME_WAIT (RFC 6191); anything else is ACKed, in case the last ACK was lost
+int tcp_timewait_rx(BYTE *data)
 {
+    ETHERHDR *ehp = (ETHERHDR *)data;
+    IPHDR *ip = (IPHDR *)&data[sizeof(ETHERHDR)];
+    TCPHDR *tcp = (TCPHDR *)&data[IP_DATA_OFFSET];
+    WORD remport = htons(tcp->sport), locport = htons(tcp->dport);
+    TCP_TIMEWAIT *tw = tcp_timewaits;
     int i;
     
-    for (i = 0; i < TCP_NUM_SOCKETS; i++)
+    for (i = 0; i < TCP_TIMEWAIT_LEN; i++, tw++)
     {
-        if (net_sockets[i].state)
-            tcp_sock_rx(i, 0, 0);
+        if (tw->loc_port == locport && tw->rem_port == remport && IP_CMP(tw->rem_ip, ip->sip))
+            break;
     }
+    if (i >= TCP_TIMEWAIT_LEN)
+        return (0);
+    if (ustime() - tw->ticks >= TCP_TIMEWAIT_USEC ||
+        ((tcp->flags & (TCP_SYN + TCP_ACK)) == TCP_SYN && (int)(htonl(tcp->seq) - tw->ack) > 0))
+    {
+        tw->loc_port = 0;
+        return (0);
+    }
+    if (!(tcp->flags & TCP_RST))
+        tcp_tx(-1, txbuff, ehp->srce, ip->sip, remport, locport, tw->seq, tw->ack, TCP_ACK, 0, 0);
+    return (1);
+}
+
+// Poll active TCP sockets for timeout
+// Go backwards through list, as sockets may be removed while polling
+void tcp_socks_poll(void)
+{
+    int i;
+    
+    tcp_ts_clock();
+    for (i = tcp_nactive - 1; i >= 0; i--)
+        tcp_sock_rx(tcp_active[i], 0, 0);
+    tcp_synq_poll();
+}
+
+// Add or remove socket from the list of active sockets, that need polling
+void tcp_sock_active(int sock, bool active)
+{
+    int i;
+
+    for (i = 0; i < tcp_nactive && tcp_active[i] != sock; i++) ;
+    if (active && i >= tcp_nactive)
+        tcp_active[tcp_nactive++] = (BYTE)sock;
+    else if (!active && i < tcp_nactive)
+        tcp_active[i] = tcp_active[--tcp_nactive];
 }
 
 // Receive incoming TCP segment; if no data, just check for socket timeout
 int tcp_sock_rx(int sock, BYTE *data, int len)
 {
-    ETHERHDR *ehp = (ETHERHDR *)data;
-    IPHDR *ip = 0;
     TCPHDR *tcp = 0;
     NET_SOCKET *ts = &net_sockets[sock];
-    BYTE rflags = 0;
-    int hlen = 0;
+    BYTE rflags = 0, news;
+    int hlen = 0, n;
 
     if (data)
     {
-        ip = (IPHDR *)&data[sizeof(ETHERHDR)];
         tcp = (TCPHDR *)&data[IP_DATA_OFFSET];
         hlen = (tcp->hlen & 0xf0) >> 2;
         rflags = tcp->flags & (TCP_FIN + TCP_SYN + TCP_RST + TCP_ACK);
@@ -173,166 +560,166 @@ int tcp_sock_rx(int sock, BYTE *data, int len)
         ts->rx_seq = htonl(tcp->seq);
         ts->rx_ack = htonl(tcp->ack);
         ts->rxdlen = len - IP_DATA_OFFSET - hlen;
+        ts->keep_ticks = ustime();
+        ts->keep_probes = 0;
+        tcp_stats[sock].segs_in++;
+        tcp_stats[sock].bytes_in += MAX(ts->rxdlen, 0);
+        // Discard an old duplicate segment (PAWS), just send an ACK
+        if (!tcp_sock_rx_opts(sock, data))
+        {
+            tcp_stats[sock].paws_drops++;
+            tcp_sock_send(sock, TCP_ACK, 0, 0);
+            return (1);
+        }
+        if (tcp->window == 0 && ts->rx_win != 0)
+            tcp_stats[sock].zero_wins_rx++;
+        ts->rx_win = htons(tcp->window);
+        if (!(tcp->flags & TCP_SYN) && ts->wscale_ok)
+            ts->rx_win <<= ts->wscale_tx;
     }
-    accept_socket = -1;
     switch (ts->state)
     {
-    // Listening socket, receiving connection request
+    // Listening socket, receiving connection request, or ACK of SYN ACK
     case T_LISTEN:
-        if (rflags & TCP_SYN)
-        {
-            MAC_CPY(ts->rem_mac, ehp->srce);
-            IP_CPY(ts->rem_ip, ip->sip);
-            ts->loc_port = htons(tcp->dport);
-            ts->rem_port = htons(tcp->sport);
-            ts->seq = ustime();
-            ts->start_seq = ts->seq + 1;
-            ts->ack = ts->rx_seq + 1;
-            tcp_sock_send(sock, TCP_SYN + TCP_ACK, 0, 0);
-            tcp_new_state(sock, T_SYN_RCVD);
-            ts->seq++;
-            accept_socket = sock;
-            ts->errors = 0;
-        }
+        if (data)
+            return (tcp_listen_rx(sock, data, len));
         break;
-    // Sent SYN ACK, waiting for ACK
-    case T_SYN_RCVD:
-        if ((rflags & TCP_ACK) && ts->rx_seq == ts->ack && ts->rx_ack == ts->seq)
+    // Client sent SYN, waiting for SYN ACK
+    case T_SYN_SENT:
+        if ((rflags & TCP_RST) && ts->rx_ack == ts->seq)
+            tcp_new_state(sock, T_FAILED);
+        else if ((rflags & (TCP_SYN+TCP_ACK)) == TCP_SYN+TCP_ACK && ts->rx_ack == ts->seq)
         {
-            ts->last_rx_ack = ts->ack;
+            ts->ack = ts->rx_read = ts->rx_seq + 1;
+            tcp_sock_cwnd_init(sock);
+            tcp_sock_rtt_ack(sock);
+            ts->last_rx_ack = ts->rx_ack;
+            ts->last_rx_win = ts->rx_win;
+            ts->tries = 0;
+            tcp_sock_send(sock, TCP_ACK, 0, 0);
             tcp_new_state(sock, T_ESTABLISHED);
         }
-        else if (ustimeout(&ts->ticks, TCP_RETRY_USEC) && !tcp_sock_fail(sock))
+        // Send SYN when ARP response is received for the next hop
+        else if (!MAC_IS_NONZERO(ts->rem_mac) && ip_find_arp(ip_next_hop(ts->rem_ip), ts->rem_mac))
+            tcp_sock_syn(sock);
+        // Resend SYN or ARP request if no response
+        else if (ustimeout(&ts->ticks, tcp_sock_rto(sock)) && !tcp_sock_fail(sock))
         {
-            ts->seq--;
-            tcp_sock_send(sock, TCP_SYN + TCP_ACK, 0, 0);
-            ts->seq++;
+            ts->rtt_timing = 0;
+            ts->rto = MIN(tcp_sock_rto(sock) * 2, TCP_RTO_MAX);
+            tcp_sock_syn(sock);
         }
         break;
     // Connection established, waiting for data or closure
     case T_ESTABLISHED:
-        ts->txdlen = 0;
         // Handle incoming TCP reset
         if ((rflags & TCP_RST) && ts->rx_seq == ts->ack)
         {
             tcp_new_state(sock, T_FAILED);
         }
-        // Handle incoming TCP FIN
-        else if ((rflags & TCP_FIN) && ts->rx_seq == ts->ack)
-        {
-            ts->ack++;
-            tcp_sock_send(sock, TCP_ACK, 0, ts->txdlen);
-            tcp_new_state(sock, T_CLOSE_WAIT);
-        }
-        else if (rflags && ts->rx_ack == ts->seq)
+        else if (rflags)
         {
+            // Remove acknowledged segments from Tx queue
+            if (rflags & TCP_ACK)
+                tcp_sock_ack(sock, rflags);
             // Segment has been received
-            if (ts->rxdlen != 1)
+            if (ts->rx_ack == ts->seq)
                 ts->tries = 0;
-            // Handle incoming data, put outgoing data in socket buffer
-            if (ts->rxdlen > 0 && ts->rx_seq == ts->ack)
+            // Handle incoming data, put outgoing data in Tx queue
+            // ACK immediately if data isn't all in sequence, or there is a gap
+            tcp_sock_rx_fin(sock, rflags);
+            if (ts->rxdlen > 0)
             {
-                tcp_get_resp(sock, &data[IP_DATA_OFFSET + hlen], ts->rxdlen);
-                ts->ack += ts->rxdlen;
+                n = tcp_sock_rx_data(sock, &data[IP_DATA_OFFSET + hlen]);
+                if (n > 0 && ts->txdlen > 0 && !tcp_sock_tx_hold(sock))
+                    tcp_sock_queue(sock, TCP_ACK);
+                else if (!tcp_sock_rx_fin(sock, 0))
+                    tcp_sock_delack(sock, n != ts->rxdlen || (ts->rxq_count > 0 &&
+                        (int)(ts->rxq[ts->rxq_count - 1].seq - ts->ack) > 0));
             }
-            // Remote closing of connection
-            if (rflags & TCP_FIN)
+            else
+                tcp_sock_rx_old(sock, rflags);
+            // Remote closing of connection, once all the data before the FIN
+            // has been received; the application may still have data to read
+            if (tcp_sock_rx_fin(sock, 0))
             {
                 ts->ack++;
-                tcp_sock_send(sock, TCP_ACK, 0, ts->txdlen);
+                tcp_sock_send(sock, TCP_ACK, 0, 0);
                 tcp_new_state(sock, T_CLOSE_WAIT);
             }
-            // Connection failure
-            if (rflags & TCP_RST)
-            {
-                tcp_new_state(sock, T_FAILED);
-            }
-            // Send data in socket Tx buffer
-            else if (ts->txdlen > 0)
-            {
-                tcp_sock_send(sock, TCP_ACK, 0, ts->txdlen);
-                ts->seq += ts->txdlen;
-            }
-            // Local closing of connection
-            else if (ts->close)
-            {
-                tcp_sock_send(sock, TCP_FIN + TCP_ACK, 0, 0);
-                ts->seq++;
-                tcp_new_state(sock, T_FIN_WAIT_1);
-            }
         }
-        // ACK does not match SEQ; rewind transmission
-        else if (rflags & TCP_ACK)
+        // Retransmit unacknowledged data if timeout
+        else if (ts->txq_count > 0)
+            tcp_sock_retry(sock);
+        // Check idle connection is OK
+        else if (!ts->keep_off)
+            tcp_sock_keepalive(sock);
+        // Give saved data to application when it is ready, update window
+        if (ts->state == T_ESTABLISHED && ts->rx_read != ts->ack &&
+            tcp_sock_rx_deliver(sock) > 0)
         {
-            if (ts->last_rx_ack != ts->rx_ack)
-                ts->last_rx_ack = ts->rx_ack;
+            if (ts->txdlen > 0 && !tcp_sock_tx_hold(sock))
+                tcp_sock_queue(sock, TCP_ACK);
             else
-            {
-                ts->seq = ts->rx_ack;
-                ts->errors++;
-            }
-        }
-        // Check connection is OK: send ACK, should receive ACK
-        else if (ustimeout(&ts->ticks, TCP_CHECK_USEC) && !tcp_sock_fail(sock))
-        {
-            ts->seq--;
-            tcp_sock_send(sock, TCP_ACK, "\0", 1);
-            ts->seq++;
-        }
-        // Get more data to send
-        else if (!ts->close && ts->web_handler)
-        { 
-            ts->txdlen = 0;
-            if (ts->web_handler(sock, 0, ts->seq - ts->start_seq) > 0)
-            {
-                tcp_sock_send(sock, TCP_ACK, 0, ts->txdlen);
-                ts->seq += ts->txdlen;
-            }
+                tcp_sock_win_update(sock);
         }
+        // Get more data to send, or close connection
+        if (ts->state == T_ESTABLISHED)
+            tcp_sock_tx_more(sock);
+        // Send delayed ACK, if it hasn't been sent with data
+        if (ts->ack_pending && ustimeout(&ts->ack_ticks, TCP_DELACK_USEC))
+            tcp_sock_send(sock, TCP_ACK, 0, 0);
         break;
     // Remote connection close: received FIN from client, send FIN ACK
+    // when the application has all the data, and all queued data has been
+    // acknowledged
+    // A socket with rings sends its remaining data, then waits for the
+    // application to close it
     case T_CLOSE_WAIT:
-        tcp_sock_send(sock, TCP_FIN + TCP_ACK, 0, 0);
-        ts->seq++;
-        tcp_new_state(sock, T_LAST_ACK);
+        if (rflags & TCP_ACK)
+            tcp_sock_ack(sock, rflags);
+        tcp_sock_rx_old(sock, rflags);
+        if (ts->txq_count > 0)
+            tcp_sock_retry(sock);
+        if (ts->rx_read != ts->fin_seq)
+            tcp_sock_rx_deliver(sock);
+        if (ts->ring)
+            tcp_sock_tx_more(sock);
+        else if (ts->txq_count == 0 && ts->rx_read == ts->fin_seq &&
+            tcp_sock_queue(sock, TCP_FIN + TCP_ACK))
+            tcp_new_state(sock, T_LAST_ACK);
         break;
     // Sent FIN ACK, waiting for final ACK
     case T_LAST_ACK:
-        if ((rflags & TCP_ACK)  && ts->rx_seq == ts->ack)
+        if (rflags & TCP_ACK)
+            tcp_sock_ack(sock, rflags);
+        tcp_sock_rx_old(sock, rflags);
+        if (ts->txq_count == 0)
             tcp_new_state(sock, T_FINISHED);
-        else if (ustimeout(&ts->ticks, TCP_RETRY_USEC) && !tcp_sock_fail(sock))
-        {
-            ts->seq--;
-            tcp_sock_send(sock, TCP_FIN + TCP_ACK, 0, 0);
-            ts->seq++;
-        }
+        else
+            tcp_sock_retry(sock);
         break;
-    // Local connection close: FIN has been sent, wait for FIN or ACK
+    // Local connection close: FIN has been queued, wait for FIN or ACK
+    // Data is still received until the remote closes
     case T_FIN_WAIT_1:
-        if ((rflags & TCP_FIN) && (rflags & TCP_ACK) && ts->rx_seq == ts->ack)
-        {
-            ts->ack++;
-            tcp_sock_send(sock, TCP_ACK, 0, 0);
-            tcp_new_state(sock, T_TIME_WAIT);
-        }
-        else if ((rflags & TCP_FIN) && ts->rx_seq == ts->ack)
+        if (rflags & TCP_ACK)
+            tcp_sock_ack(sock, rflags);
+        tcp_sock_rx_closing(sock, data ? &data[IP_DATA_OFFSET + hlen] : 0, rflags);
+        if (tcp_sock_rx_fin(sock, 0))
         {
             ts->ack++;
             tcp_sock_send(sock, TCP_ACK, 0, 0);
-            tcp_new_state(sock, T_CLOSING);
+            tcp_new_state(sock, ts->txq_count ? T_CLOSING : T_TIME_WAIT);
         }
-        else if ((rflags & TCP_ACK)  && ts->rx_seq == ts->ack)
+        else if (ts->txq_count == 0)
             tcp_new_state(sock, T_FIN_WAIT_2);
-        else if (ustimeout(&ts->ticks, TCP_RETRY_USEC) && !tcp_sock_fail(sock))
-        {
-            ts->seq--;
-            tcp_sock_send(sock, TCP_FIN + TCP_ACK, 0, 0);
-            ts->seq++;
-        }
+        else
+            tcp_sock_retry(sock);
         break;
     // FIN sent & ACK received, awaiting FIN from remote
     case T_FIN_WAIT_2:
-        if ((rflags & TCP_FIN) && ts->rx_seq == ts->ack)
+        tcp_sock_rx_closing(sock, data ? &data[IP_DATA_OFFSET + hlen] : 0, rflags);
+        if (tcp_sock_rx_fin(sock, 0))
         {
             ts->ack++;
             tcp_sock_send(sock, TCP_ACK, 0, 0);
@@ -341,170 +728,1392 @@ int tcp_sock_rx(int sock, BYTE *data, int len)
         else if (ustimeout(&ts->ticks, TCP_RETRY_USEC))
             tcp_sock_fail(sock);
         break;
-    // Disconnection is complete
-    case T_TIME_WAIT:
-    case T_FINISHED:
-    case T_FAILED:
-        tcp_sock_clear(sock);
-        tcp_new_state(sock, T_LISTEN);
+    // FIN sent & FIN received, awaiting ACK of FIN
+    case T_CLOSING:
+        if (rflags & TCP_ACK)
+            tcp_sock_ack(sock, rflags);
+        tcp_sock_rx_old(sock, rflags);
+        if (ts->txq_count == 0)
+            tcp_new_state(sock, T_TIME_WAIT);
+        else
+            tcp_sock_retry(sock);
         break;
     }
+    // Disconnection is complete, so clear the socket now for re-use; a
+    // TIME_WAIT entry is kept to handle any late segments
+    // Client or accepted socket is closed, server socket returns to listening
+    if (ts->state == T_TIME_WAIT || ts->state == T_FINISHED || ts->state == T_FAILED)
+    {
+        if (ts->state == T_TIME_WAIT)
+            tcp_timewait_add(sock);
+        news = ts->client || ts->parent ? T_CLOSED : T_LISTEN;
+        tcp_sock_clear(sock);
+        tcp_new_state(sock, news);
+    }
     return (1);
 }
 
-// Clear TCP socket
+// Clear TCP socket, and free its buffers
+// A client or accepted socket loses its port, so it can be re-used; if the
+// application holds it, the slot is kept until the application closes it
 void tcp_sock_clear(int sock)
 {
     NET_SOCKET *ts = &net_sockets[sock];
-    WORD locport = ts->loc_port;
-    int state = ts->state;
+    WORD locport = ts->client || ts->parent ? 0 : ts->loc_port;
+    int i, state = ts->state, type = ts->sock_type;
+    int app_open = ts->app_open && !ts->close;
     
+    tcp_sock_unqueue(sock);
+    tcp_stats_end(sock);
+    memset(&tcp_tmpls[sock], 0, sizeof(TCP_HDR_TMPL));
+    for (i = 0; i < TCP_TXQ_SEGS; i++)
+        tcp_sock_seg_free(sock, &ts->txq[i]);
+    for (i = 0; i < ts->rxq_count; i++)
+        buff_free(ts->rxq[i].data);
+    if (ts->ring)
+        ts->ring->used = 0;
     memset(ts, 0, sizeof(NET_SOCKET));
     ts->loc_port = locport;
     ts->state = state;
+    ts->sock_type = type;
+    ts->app_open = app_open;
+    net_sock_hash(sock);
 }
 
 // Read in TCP request, get response into socket Tx buffer, return length
+// A client socket handler gets the Rx data, with the length as offset value
+// A socket with rings puts the data in its Rx ring, for recv()
 int tcp_get_resp(int sock, BYTE *data, int dlen)
 {
+    NET_SOCKET *ts = &net_sockets[sock];
+
+    if (ts->ring)
+        return (tcp_sock_ring_rx(sock, data, dlen));
+    if (ts->client)
+        return (ts->web_handler ? ts->web_handler(sock, (char *)data, dlen) : 0);
     return(web_page_rx(sock, (char *)data, dlen));
 }
 
-// Add Tx data to a TCP socket
-int tcp_sock_add_tx_data(int sock, BYTE *data, int dlen)
+// Handle incoming data, return number of in-sequence bytes received
+// Data is given to the application if it is ready, otherwise it is saved
+// in the receive queue, as is out-of-sequence data until the gap is filled
+int tcp_sock_rx_data(int sock, BYTE *data)
 {
     NET_SOCKET *ts = &net_sockets[sock];
-    
-    if (dlen<=0 || TCP_DATA_OFFSET+ts->txdlen+dlen > TCP_MSS)
+    TCP_RXSEG *rxs;
+    int oset = ts->rx_seq - ts->ack, dlen = ts->rxdlen, n, i;
+
+    // Discard data that has already been received
+    if (oset < 0)
+    {
+        data -= oset;
+        dlen += oset;
+        oset = 0;
+    }
+    // Discard data that is outside the receive window
+    dlen = MIN(dlen, tcp_sock_rx_win(sock) - oset);
+    if (oset > 0)
+        tcp_stats[sock].ooo_segs++;
+    if (dlen <= 0)
+    {
+        if (oset > 0)
+            tcp_stats[sock].ooo_drops++;
         return (0);
-    memcpy(&ts->txbuff[TCP_DATA_OFFSET + ts->txdlen], data, dlen);
-    ts->txdlen += dlen;
-    return (dlen);
+    }
+    // Save out-of-sequence data
+    if (oset > 0)
+    {
+        if ((n = tcp_sock_rxq_add(sock, ts->ack + oset, data, dlen)) > 0)
+            ts->sack_seq = ts->ack + oset;
+        if (n < dlen)
+            tcp_stats[sock].ooo_drops++;
+        return (0);
+    }
+    // Give in-sequence data to application, or save it if not ready
+    if (ts->rx_read == ts->ack && tcp_sock_rx_ready(sock))
+    {
+        tcp_get_resp(sock, data, dlen);
+        ts->rx_read += dlen;
+    }
+    else if ((dlen = tcp_sock_rxq_add(sock, ts->ack, data, dlen)) <= 0)
+        return (0);
+    ts->ack += n = dlen;
+    // Saved data may now be in sequence
+    for (i = 0; i < ts->rxq_count && (int)(ts->rxq[i].seq - ts->ack) <= 0; i++)
+    {
+        rxs = &ts->rxq[i];
+        if ((dlen = rxs->seq + rxs->len - ts->ack) > 0)
+        {
+            ts->ack += dlen;
+            n += dlen;
+        }
+    }
+    tcp_sock_rx_deliver(sock);
+    return (n);
 }
 
-// Change state of socket
-void tcp_new_state(int sock, BYTE news)
+// Handle data received after the local close, and give saved data to
+// the application when it is ready; the data is ACKed at once, unless
+// the segment has a FIN in sequence, which is ACKed instead
+void tcp_sock_rx_closing(int sock, BYTE *data, BYTE rflags)
 {
     NET_SOCKET *ts = &net_sockets[sock];
 
-    if ((display_mode & DISP_TCP_STATE) && ts->state < T_NUM_STATES && news < T_NUM_STATES)
-        printf("TCP socket %u state %s -> %s\n", sock,
-            tstate_strings[ts->state], tstate_strings[news]);
-    ts->state = news;
-    ts->ticks = ustime();
-}
-
-// If retry count has been exceeded, reset socket
-int tcp_sock_fail(int sock)
-{
-    NET_SOCKET *ts = &net_sockets[sock];
-    
-    if (++ts->tries >= TCP_TRIES)
+    tcp_sock_rx_fin(sock, rflags);
+    if (data && ts->rxdlen > 0)
     {
-        tcp_sock_send(sock, TCP_RST, 0, 0);
-        tcp_new_state(sock, T_FAILED);
-        return (1);
+        tcp_sock_rx_data(sock, data);
+        if (!tcp_sock_rx_fin(sock, 0))
+            tcp_sock_send(sock, TCP_ACK, 0, 0);
     }
-    return (0);
+    else
+        tcp_sock_rx_old(sock, rflags);
+    if (ts->rx_read != ts->ack)
+        tcp_sock_rx_deliver(sock);
 }
 
-// Close a socket
-void tcp_sock_close(int sock)
+// ACK a segment without data that is before the receive window, such as
+// a keepalive probe one below the next sequence number, or a repeated FIN
+void tcp_sock_rx_old(int sock, BYTE rflags)
 {
-    NET_SOCKET *ts = net_socket_ptr(sock);
-    
-    ts->close = 1;
+    NET_SOCKET *ts = &net_sockets[sock];
+
+    if (rflags && !(rflags & TCP_RST) && ts->rxdlen <= 0 && (int)(ts->rx_seq - ts->ack) < 0)
+        tcp_sock_send(sock, TCP_ACK, 0, 0);
 }
 
-// Send a TCP segment from a socket
-int tcp_sock_send(int sock, BYTE flags, void *data, int dlen)
+// Save the sequence number of a FIN from the remote, which may arrive
+// before the data that precedes it has all been received or delivered
+// Return non-zero if the FIN is now in sequence, and can be acknowledged
+int tcp_sock_rx_fin(int sock, BYTE rflags)
 {
     NET_SOCKET *ts = &net_sockets[sock];
+    DWORD seq = ts->rx_seq + ts->rxdlen;
 
-    ts->ticks = (DWORD)ustime();
-    return(tcp_tx(sock, ts->txbuff, ts->rem_mac, ts->rem_ip, ts->rem_port, ts->loc_port,
-        ts->seq, ts->ack, flags, data, dlen));
+    if ((rflags & TCP_FIN) && !ts->fin_rx && (int)(seq - ts->ack) >= 0 &&
+        (int)(seq - ts->ack) <= tcp_sock_rx_win(sock))
+    {
+        ts->fin_rx = 1;
+        ts->fin_seq = seq;
+    }
+    return (ts->fin_rx && ts->ack == ts->fin_seq);
 }
 
-// Send a TCP 'reset' to client
-int tcp_send_reset(int sock, MACADDR mac, IPADDR dip, WORD remport, WORD locport, DWORD seq, DWORD ack)
+// Give saved in-sequence data to the application, if it is ready
+// Return the number of bytes given
+int tcp_sock_rx_deliver(int sock)
 {
-    tcp_tx(sock, txbuff, mac, dip, remport, locport, seq, ack, TCP_RST+TCP_ACK, 0, 0);
-    return (1);
+    NET_SOCKET *ts = &net_sockets[sock];
+    TCP_RXSEG *rxs;
+    int oset, dlen, n = 0;
+
+    if (!tcp_sock_rx_ready(sock))
+        return (0);
+    while (ts->rxq_count > 0 && (int)(ts->rxq[0].seq - ts->ack) < 0)
+    {
+        rxs = &ts->rxq[0];
+        oset = ts->rx_read - rxs->seq;
+        if ((dlen = MIN(rxs->len, (int)(ts->ack - rxs->seq)) - oset) > 0)
+        {
+            tcp_get_resp(sock, &rxs->data[oset], dlen);
+            ts->rx_read += dlen;
+            n += dlen;
+        }
+        buff_free(rxs->data);
+        ts->rxq_count--;
+        memmove(ts->rxq, &ts->rxq[1], ts->rxq_count * sizeof(TCP_RXSEG));
+    }
+    return (n);
+}
+
+// Return non-zero if the application is ready for received data
+// A socket with rings always is; a client socket without a handler
+// keeps the data queued until the application calls recv()
+int tcp_sock_rx_ready(int sock)
+{
+    NET_SOCKET *ts = &net_sockets[sock];
+
+    if (ts->ring)
+        return (1);
+    return (ts->client && !ts->web_handler ? 0 : tcp_sock_txq_free(sock));
+}
+
+// Return the receive window; the free space in the receive buffer,
+// less any data in the Rx ring that the application hasn't read
+int tcp_sock_rx_win(int sock)
+{
+    NET_SOCKET *ts = &net_sockets[sock];
+    int n = ts->ring ? ts->ring->rx_in - ts->ring->rx_out : 0;
+
+    return (MAX(TCP_WINDOW - (int)(ts->ack - ts->rx_read) - n, 0));
+}
+
+// Send ACK for received data now, or after a delay (RFC 1122)
+// Every second segment is ACKed, unless the ACK can be sent with data
+void tcp_sock_delack(int sock, bool now)
+{
+    NET_SOCKET *ts = &net_sockets[sock];
+
+    if (ts->ack_pending++ == 0)
+        ustimeout(&ts->ack_ticks, 0);
+    if (now || ts->ack_pending >= TCP_DELACK_SEGS)
+        tcp_sock_send(sock, TCP_ACK, 0, 0);
+}
+
+// Send a window update if the application has freed enough space
+// for the remote to send another full segment (RFC 1122 SWS avoidance)
+void tcp_sock_win_update(int sock)
+{
+    NET_SOCKET *ts = &net_sockets[sock];
+
+    if (tcp_sock_rx_win(sock) - (int)ts->rx_win_sent >= MIN(TCP_MSS, TCP_WINDOW / 2))
+        tcp_sock_send(sock, TCP_ACK, 0, 0);
+}
+
+// Save segment in pool buffers, keeping the queue in sequence order,
+// filling any space at the end of the previous buffer first
+// Return the number of bytes saved, zero if no queue entry or buffer free
+int tcp_sock_rxq_add(int sock, DWORD seq, BYTE *data, int len)
+{
+    NET_SOCKET *ts = &net_sockets[sock];
+    TCP_RXSEG *rxq = ts->rxq;
+    BYTE *buff;
+    int i = 0, n = 0;
+
+    // Skip segments that are earlier, check if data is already saved
+    while (i < ts->rxq_count && (int)(rxq[i].seq - seq) <= 0)
+    {
+        if ((int)(rxq[i].seq + rxq[i].len - (seq + len)) >= 0)
+            return (len);
+        i++;
+    }
+    if (i > 0 && rxq[i - 1].seq + rxq[i - 1].len == seq)
+    {
+        n = MIN(len, TCP_RXSEG_MAXLEN - rxq[i - 1].len);
+        memcpy(&rxq[i - 1].data[rxq[i - 1].len], data, n);
+        rxq[i - 1].len += n;
+        if (n >= len)
+            return (n);
+    }
+    if (ts->rxq_count >= TCP_RXQ_SEGS || !(buff = buff_alloc()))
+        return (n);
+    len = MIN(len - n, TCP_RXSEG_MAXLEN);
+    memcpy(buff, &data[n], len);
+    memmove(&rxq[i + 1], &rxq[i], (ts->rxq_count - i) * sizeof(TCP_RXSEG));
+    ts->rxq_count++;
+    rxq[i].seq = seq + n;
+    rxq[i].len = len;
+    rxq[i].data = buff;
+    return (n + len);
+}
+
+// Add Tx data to a TCP socket
+int tcp_sock_add_tx_data(int sock, BYTE *data, int dlen)
+{
+    NET_SOCKET *ts = &net_sockets[sock];
+    TCP_TXSEG *seg = &ts->txq[(ts->txq_out + ts->txq_count) % TCP_TXQ_SEGS];
+    DWORD sum;
+    
+    if (dlen<=0 || ts->txq_count >= TCP_TXQ_SEGS || seg->ref ||
+        ts->txdlen + dlen > ts->mss ||
+        (!seg->frame && !(seg->frame = buff_alloc())))
+        return (0);
+    if (ts->txdlen == 0)
+    {
+        ts->cork_ticks = ustime();
+        seg->csum = 0;
+    }
+    sum = csum_copy(&seg->frame[TCP_SEG_DATA_OFFSET + ts->txdlen], data, dlen);
+    seg->csum += ts->txdlen & 1 ? csum_swap(sum) : sum;
+    ts->txdlen += dlen;
+    return (dlen);
+}
+
+// Add a reference to Tx data in application memory, so it isn't copied
+// It ends the segment; the data must be unchanged until it is released
+int tcp_sock_add_tx_ref(int sock, const BYTE *data, int dlen, tx_release_t release)
+{
+    NET_SOCKET *ts = &net_sockets[sock];
+    TCP_TXSEG *seg = &ts->txq[(ts->txq_out + ts->txq_count) % TCP_TXQ_SEGS];
+    DWORD sum;
+    
+    if (dlen<=0 || ts->txq_count >= TCP_TXQ_SEGS || seg->ref ||
+        ts->txdlen + dlen > ts->mss ||
+        (!seg->frame && !(seg->frame = buff_alloc())))
+        return (0);
+    if (ts->txdlen == 0)
+    {
+        ts->cork_ticks = ustime();
+        seg->csum = 0;
+    }
+    sum = csum_data(data, dlen);
+    seg->csum += ts->txdlen & 1 ? csum_swap(sum) : sum;
+    seg->ref = data;
+    seg->reflen = dlen;
+    seg->release = release;
+    ts->txdlen += dlen;
+    return (dlen);
+}
+
+// Return the number of data bytes that can be queued for transmission,
+// given the remote & congestion windows, the space in the Tx queue, free
+// buffers, and the time since the last segment if the socket is paced
+int tcp_sock_tx_space(int sock)
+{
+    NET_SOCKET *ts = &net_sockets[sock];
+    
+    if (ts->pace_rate && ustime() - ts->pace_ticks < ts->pace_usec)
+        return (0);
+    return (!tcp_sock_txq_free(sock) ? 0 : tcp_sock_tx_win(sock));
+}
+
+// Return the number of data bytes the remote & congestion windows allow
+// The first two duplicate ACKs each allow another segment (RFC 3042)
+int tcp_sock_tx_win(int sock)
+{
+    NET_SOCKET *ts = &net_sockets[sock];
+    DWORD cwnd = ts->cwnd + (ts->fast_recovery ? 0 : MIN(ts->dup_acks, 2) * ts->mss);
+    int n = (int)MIN(ts->rx_win, cwnd) - (int)(ts->seq - tcp_sock_unacked(sock));
+    
+    return (MAX(n, 0));
+}
+
+// Return non-zero if a segment can be added to the Tx queue; there must be
+// a free entry in the queue, and a frame buffer for it
+int tcp_sock_txq_free(int sock)
+{
+    NET_SOCKET *ts = &net_sockets[sock];
+
+    return (ts->txq_count < TCP_TXQ_SEGS &&
+        (ts->txq[(ts->txq_out + ts->txq_count) % TCP_TXQ_SEGS].frame || buff_num_free() > 0));
+}
+
+// Get more data from the Web handler or Tx ring while there is space in the
+// Tx window, or queue a FIN if the connection is to be closed
+// The handler offset includes any data held in a partial segment; if the
+// handler returns non-zero without adding data, the held segment is sent
+// Less than a full segment is sent if the whole remote window is smaller
+// than the MSS (RFC 9293 3.8.6.1); the data is limited to the window, and
+// the handler isn't called while a held segment fills the window
+void tcp_sock_tx_more(int sock)
+{
+    NET_SOCKET *ts = &net_sockets[sock];
+    int n;
+    
+    tcp_sock_resend_more(sock);
+    tcp_sock_tx_flush(sock);
+    while ((ts->ring ? tcp_sock_ring_unsent(sock) > 0 : !ts->close && ts->web_handler != 0) &&
+        tcp_sock_tx_space(sock) >= MAX(MIN(ts->mss, (int)ts->rx_win), 1) &&
+        tcp_sock_tx_room(sock) > 0)
+    {
+        n = ts->txdlen;
+        if ((ts->ring ? tcp_sock_ring_tx(sock) :
+            ts->web_handler(sock, 0, ts->seq + n - ts->start_seq)) <= 0)
+            break;
+        if (ts->txdlen == n && (n == 0 || tcp_sock_tx_space(sock) < n ||
+            !tcp_sock_queue(sock, TCP_ACK)))
+            break;
+        if (ts->txdlen > 0 && !tcp_sock_tx_hold(sock) &&
+            (tcp_sock_tx_space(sock) < ts->txdlen || !tcp_sock_queue(sock, TCP_ACK)))
+            break;
+    }
+    tcp_sock_tx_flush(sock);
+    if (ts->close && tcp_sock_txq_free(sock) && tcp_sock_ring_unsent(sock) == 0)
+    {
+        if (tcp_sock_queue(sock, TCP_FIN + TCP_ACK))
+            tcp_new_state(sock, ts->state == T_CLOSE_WAIT ? T_LAST_ACK : T_FIN_WAIT_1);
+    }
+    tcp_sock_persist(sock);
+}
+
+// Return non-zero if a partial Tx segment should be held, to add more data
+// When corked, it is held until full, or for a max time; with the Nagle
+// algorithm, it is held while there is unacknowledged data
+int tcp_sock_tx_hold(int sock)
+{
+    NET_SOCKET *ts = &net_sockets[sock];
+
+    return (tcp_sock_tx_room(sock) > 0 && !ts->close &&
+        ((ts->cork && ustime() - ts->cork_ticks < TCP_CORK_USEC) ||
+         (ts->nagle && ts->txq_count > 0)));
+}
+
+// Send partial Tx segment if it isn't being held, and the window allows
+int tcp_sock_tx_flush(int sock)
+{
+    NET_SOCKET *ts = &net_sockets[sock];
+
+    return (ts->txdlen > 0 && !tcp_sock_tx_hold(sock) &&
+        tcp_sock_tx_space(sock) >= ts->txdlen && tcp_sock_queue(sock, TCP_ACK));
+}
+
+// Return the space for more data in the current Tx segment, given the MSS
+// and the remote & congestion windows
+int tcp_sock_tx_room(int sock)
+{
+    NET_SOCKET *ts = &net_sockets[sock];
+
+    return (ts->txq[(ts->txq_out + ts->txq_count) % TCP_TXQ_SEGS].ref ? 0 :
+        MAX(MIN(ts->mss, tcp_sock_tx_win(sock)) - ts->txdlen, 0));
+}
+
+// Add the pending Tx data to the Tx queue, and send it
+int tcp_sock_queue(int sock, BYTE flags)
+{
+    NET_SOCKET *ts = &net_sockets[sock];
+    TCP_TXSEG *seg = &ts->txq[(ts->txq_out + ts->txq_count) % TCP_TXQ_SEGS];
+    
+    if (ts->txq_count >= TCP_TXQ_SEGS || (!seg->frame && !(seg->frame = buff_alloc())))
+        return (0);
+    seg->seq = ts->seq;
+    seg->dlen = ts->txdlen;
+    seg->flags = flags;
+    seg->sacked = seg->resent = seg->pending = 0;
+    if (ts->txq_count++ == 0)
+        ustimeout(&ts->rtx_ticks, 0);
+    if (ts->pace_rate && ts->txdlen > 0)
+    {
+        ts->pace_ticks = ustime();
+        ts->pace_usec = (uint32_t)ts->txdlen * 1000000 / ts->pace_rate;
+    }
+    tcp_sock_send_seg(sock, seg);
+    tcp_sock_rtt_start(sock, ts->seq + ts->txdlen + (flags & TCP_FIN ? 1 : 0));
+    ts->seq += ts->txdlen + (flags & TCP_FIN ? 1 : 0);
+    ts->txdlen = 0;
+    return (1);
+}
+
+// Remove acknowledged segments from the Tx queue, return byte count
+// Duplicate ACKs trigger fast retransmit of the missing segments
+int tcp_sock_ack(int sock, BYTE rflags)
+{
+    NET_SOCKET *ts = &net_sockets[sock];
+    TCP_TXSEG *seg;
+    DWORD end;
+    int n = 0;
+
+    while (ts->txq_count > 0)
+    {
+        seg = &ts->txq[ts->txq_out];
+        end = seg->seq + seg->dlen + (seg->flags & TCP_FIN ? 1 : 0);
+        if ((int)(ts->rx_ack - end) < 0)
+            break;
+        n += end - seg->seq;
+        tcp_sock_seg_free(sock, seg);
+        ts->txq_out = (ts->txq_out + 1) % TCP_TXQ_SEGS;
+        ts->txq_count--;
+    }
+    if (n > 0)
+    {
+        tcp_sock_rtt_ack(sock);
+        tcp_sock_cwnd_ack(sock, n);
+        ts->tries = 0;
+        ustimeout(&ts->rtx_ticks, 0);
+        // Partial ACK in fast recovery: resend the next missing segment,
+        // keeping the duplicate count so recovery continues
+        if (ts->fast_recovery && (int)(ts->rx_ack - ts->recover) < 0)
+            tcp_sock_resend_lost(sock);
+        else
+            ts->fast_recovery = ts->dup_acks = 0;
+    }
+    // Duplicate ACK (RFC 5681): no data, SYN or FIN, same ACK & window,
+    // data outstanding
+    // The first two allow new data to be sent (RFC 3042 limited transmit)
+    else if (ts->txq_count > 0 && ts->rx_ack != ts->seq && ts->rxdlen == 0 &&
+        !(rflags & (TCP_SYN | TCP_FIN)) &&
+        ts->rx_ack == ts->last_rx_ack && ts->rx_win == ts->last_rx_win)
+    {
+        tcp_stats[sock].dup_acks++;
+        // Enter fast recovery, resend the segments that are missing
+        if (++ts->dup_acks >= TCP_DUPACKS)
+        {
+            if (!ts->fast_recovery)
+            {
+                ts->errors++;
+                tcp_sock_cwnd_loss(sock, 0);
+                ts->fast_recovery = 1;
+                ts->recover = ts->seq;
+            }
+            else
+                ts->cwnd += ts->mss;
+            tcp_sock_resend_lost(sock);
+        }
+    }
+    ts->last_rx_ack = ts->rx_ack;
+    ts->last_rx_win = ts->rx_win;
+    return (n);
+}
+
+// Set the initial congestion window, when the connection is opened
+void tcp_sock_cwnd_init(int sock)
+{
+    NET_SOCKET *ts = &net_sockets[sock];
+
+    ts->cwnd = TCP_INIT_CWND(ts->mss);
+    ts->ssthresh = 0xffffffff;
+    ts->cwnd_acked = 0;
+}
+
+// Open the congestion window as data is acknowledged (RFC 5681): by the
+// amount acknowledged (up to a segment) in slow start, or by one segment
+// per window in congestion avoidance
+// In fast recovery, a partial ACK deflates the window (RFC 6582), and a
+// full ACK sets it to the slow start threshold
+void tcp_sock_cwnd_ack(int sock, int n)
+{
+    NET_SOCKET *ts = &net_sockets[sock];
+
+    if (ts->fast_recovery)
+    {
+        if ((int)(ts->rx_ack - ts->recover) < 0)
+            ts->cwnd = ts->cwnd > n ? ts->cwnd - n + ts->mss : ts->mss;
+        else
+            ts->cwnd = ts->ssthresh;
+    }
+    else if (ts->cwnd < ts->ssthresh)
+        ts->cwnd += MIN(n, ts->mss);
+    else if ((ts->cwnd_acked += n) >= ts->cwnd)
+    {
+        ts->cwnd_acked -= ts->cwnd;
+        ts->cwnd += ts->mss;
+    }
+    ts->cwnd = MIN(ts->cwnd, TCP_MAX_CWND(ts->mss));
+}
+
+// Reduce the congestion window when data is lost, halving the threshold
+// A timeout restarts slow start; otherwise it is fast recovery, with
+// an allowance for the segments that caused the duplicate ACKs
+void tcp_sock_cwnd_loss(int sock, bool timeout)
+{
+    NET_SOCKET *ts = &net_sockets[sock];
+    DWORD flight = ts->seq - tcp_sock_unacked(sock);
+
+    ts->ssthresh = MAX(flight / 2, 2 * (DWORD)ts->mss);
+    ts->cwnd = timeout ? ts->mss : ts->ssthresh + 3 * ts->mss;
+    ts->cwnd_acked = 0;
+}
+
+// Free the frame buffer of a Tx segment, and release any referenced data
+void tcp_sock_seg_free(int sock, TCP_TXSEG *seg)
+{
+    buff_free(seg->frame);
+    seg->frame = 0;
+    if (seg->ref && seg->release)
+        seg->release(sock, seg->ref, seg->reflen);
+    seg->ref = 0;
+    seg->reflen = 0;
+    seg->csum = 0;
+}
+
+// Retransmit the Tx queue if no acknowledgement has been received
+void tcp_sock_retry(int sock)
+{
+    NET_SOCKET *ts = &net_sockets[sock];
+
+    if (ts->txq_count > 0 && ustimeout(&ts->rtx_ticks, tcp_sock_rto(sock)) &&
+        !tcp_sock_fail(sock))
+    {
+        ts->errors++;
+        ts->rto = MIN(tcp_sock_rto(sock) * 2, TCP_RTO_MAX);
+        tcp_sock_cwnd_loss(sock, 1);
+        tcp_sock_resend(sock);
+    }
+}
+
+// Retransmit the Tx queue, discarding SACK information; after a timeout
+// the congestion window is one segment, so the rest are marked as pending
+void tcp_sock_resend(int sock)
+{
+    NET_SOCKET *ts = &net_sockets[sock];
+    TCP_TXSEG *seg;
+    
+    for (int i = 0; i < ts->txq_count; i++)
+    {
+        seg = &ts->txq[(ts->txq_out + i) % TCP_TXQ_SEGS];
+        seg->sacked = seg->resent = 0;
+        seg->pending = 1;
+    }
+    ts->fast_recovery = 0;
+    ts->dup_acks = ts->rtt_timing = 0;
+    tcp_sock_resend_more(sock);
+    ustimeout(&ts->rtx_ticks, 0);
+}
+
+// Resend the segments awaiting retransmission after a timeout, as far as
+// the congestion window allows; the oldest segment is always sent
+void tcp_sock_resend_more(int sock)
+{
+    NET_SOCKET *ts = &net_sockets[sock];
+    DWORD unacked = tcp_sock_unacked(sock);
+    TCP_TXSEG *seg;
+    
+    for (int i = 0; i < ts->txq_count; i++)
+    {
+        seg = &ts->txq[(ts->txq_out + i) % TCP_TXQ_SEGS];
+        if (seg->pending)
+        {
+            if (i > 0 && seg->seq + seg->dlen - unacked > ts->cwnd)
+                break;
+            seg->pending = 0;
+            tcp_sock_send_seg(sock, seg);
+            tcp_stats[sock].retransmits++;
+        }
+    }
+}
+
+// Retransmit the segments that are assumed to be lost; that is the segments
+// before the last SACKed segment, or if no SACK, the oldest segment
+void tcp_sock_resend_lost(int sock)
+{
+    NET_SOCKET *ts = &net_sockets[sock];
+    TCP_TXSEG *seg;
+    int i, n = 1;
+    
+    for (i = 0; i < ts->txq_count; i++)
+    {
+        if (ts->txq[(ts->txq_out + i) % TCP_TXQ_SEGS].sacked)
+            n = i;
+    }
+    for (i = 0; i < n; i++)
+    {
+        seg = &ts->txq[(ts->txq_out + i) % TCP_TXQ_SEGS];
+        if (!seg->sacked && !seg->resent)
+        {
+            seg->resent = 1;
+            seg->pending = 0;
+            ts->rtt_timing = 0;
+            tcp_sock_send_seg(sock, seg);
+            tcp_stats[sock].retransmits++;
+        }
+    }
+    ustimeout(&ts->rtx_ticks, 0);
+}
+
+// Get TCP options from incoming segment
+// A SYN sets the options for the connection: the segment size is limited
+// by the remote MSS, less the space for timestamps if they are used
+// Return 0 if the segment has an old timestamp, so should be discarded
+int tcp_sock_rx_opts(int sock, BYTE *data)
+{
+    NET_SOCKET *ts = &net_sockets[sock];
+    TCPHDR *tcp = (TCPHDR *)&data[IP_DATA_OFFSET];
+    BYTE *opts = &data[IP_DATA_OFFSET + sizeof(TCPHDR)];
+    int i = 0, n, olen = ((tcp->hlen & 0xf0) >> 2) - sizeof(TCPHDR);
+    int mss = TCP_MSS_DEFAULT;
+    DWORD tsval;
+
+    ts->rx_tsecr = 0;
+    if (tcp->flags & TCP_SYN)
+        ts->sack_ok = ts->wscale_ok = ts->wscale_tx = ts->ts_ok = 0;
+    while (i < olen && opts[i] != TCP_OPT_END)
+    {
+        if (opts[i] == TCP_OPT_NOP)
+        {
+            i++;
+            continue;
+        }
+        if (i + 1 >= olen || (n = opts[i + 1]) < 2 || i + n > olen)
+            break;
+        if (opts[i] == TCP_OPT_MSS && n == 4 && (tcp->flags & TCP_SYN))
+            mss = (opts[i + 2] << 8) | opts[i + 3];
+        else if (opts[i] == TCP_OPT_SACKOK && (tcp->flags & TCP_SYN))
+            ts->sack_ok = 1;
+        else if (opts[i] == TCP_OPT_WSCALE && n == 3 && (tcp->flags & TCP_SYN))
+        {
+            ts->wscale_ok = 1;
+            ts->wscale_tx = MIN(opts[i + 2], 14);
+        }
+        else if (opts[i] == TCP_OPT_SACK && (tcp->flags & TCP_ACK))
+        {
+            for (int j = i + 2; j + 8 <= i + n; j += 8)
+                tcp_sock_sack(sock, TCP_OPT_GET32(&opts[j]), TCP_OPT_GET32(&opts[j + 4]));
+        }
+        // Reject a segment with a timestamp older than the last one, unless
+        // it is a reset, or the connection has been idle for a long time
+        // Keep the remote timestamp to echo, if the segment isn't beyond
+        // the last ACK (RFC 7323)
+        else if (opts[i] == TCP_OPT_TSTAMP && n == 10)
+        {
+            tsval = TCP_OPT_GET32(&opts[i + 2]);
+            if (tcp->flags & TCP_SYN)
+                ts->ts_ok = 1;
+            else if (ts->ts_ok && ts->state != T_LISTEN && !(tcp->flags & TCP_RST) &&
+                (int)(tsval - ts->ts_recent) < 0 &&
+                tcp_ts_clock() - ts->ts_recent_age < TCP_PAWS_IDLE_MSEC)
+                return (0);
+            ts->rx_tsecr = TCP_OPT_GET32(&opts[i + 6]);
+            if (ts->ts_ok && ((tcp->flags & TCP_SYN) || (int)(ts->rx_seq - ts->ack) <= 0))
+            {
+                ts->ts_recent = tsval;
+                ts->ts_recent_age = tcp_ts_clock();
+            }
+        }
+        i += n;
+    }
+    if (tcp->flags & TCP_SYN)
+        ts->mss = MAX(MIN(mss, TCP_TX_MAXDATA) - (ts->ts_ok ? TCP_TSOPT_LEN : 0), 64);
+    return (1);
+}
+
+// Return the timestamp clock value, in milliseconds
+// It continues beyond the wrap of the microsecond timer, so must be
+// called at least once an hour; this is done when sockets are polled
+DWORD tcp_ts_clock(void)
+{
+    static uint32_t last_usec;
+    static DWORD msec;
+    uint32_t n = (ustime() - last_usec) / 1000;
+
+    msec += n;
+    last_usec += n * 1000;
+    return (msec);
+}
+
+// Mark Tx queue segments that are covered by a SACK block
+void tcp_sock_sack(int sock, DWORD left, DWORD right)
+{
+    NET_SOCKET *ts = &net_sockets[sock];
+    TCP_TXSEG *seg;
+
+    for (int i = 0; i < ts->txq_count; i++)
+    {
+        seg = &ts->txq[(ts->txq_out + i) % TCP_TXQ_SEGS];
+        if (seg->dlen > 0 && (int)(seg->seq - left) >= 0 &&
+            (int)(seg->seq + seg->dlen - right) <= 0)
+            seg->sacked = 1;
+    }
+}
+
+// Return the oldest unacknowledged sequence number
+DWORD tcp_sock_unacked(int sock)
+{
+    NET_SOCKET *ts = &net_sockets[sock];
+
+    return (ts->txq_count > 0 ? ts->txq[ts->txq_out].seq : ts->seq);
+}
+
+// Start timing a segment for round-trip time estimate, if not already
+// timing one; the sequence number is for the end of the segment
+void tcp_sock_rtt_start(int sock, DWORD seq)
+{
+    NET_SOCKET *ts = &net_sockets[sock];
+
+    if (!ts->rtt_timing)
+    {
+        ts->rtt_timing = 1;
+        ts->rtt_seq = seq;
+        ts->rtt_ticks = ustime();
+    }
+}
+
+// If the timed segment has been acknowledged, update the RTT estimate
+// Timing is cancelled if a segment is resent (Karn's algorithm), but with
+// timestamps, the echoed value gives a sample from any ACK (RFC 7323)
+void tcp_sock_rtt_ack(int sock)
+{
+    NET_SOCKET *ts = &net_sockets[sock];
+
+    if (ts->rtt_timing && (int)(ts->rx_ack - ts->rtt_seq) >= 0)
+    {
+        ts->rtt_timing = 0;
+        tcp_sock_rtt_update(sock, ustime() - ts->rtt_ticks);
+    }
+    else if (ts->ts_ok && ts->rx_tsecr)
+        tcp_sock_rtt_update(sock, (tcp_ts_clock() - ts->rx_tsecr) * 1000);
+}
+
+// Update smoothed RTT and variance, calculate retransmission timeout (RFC 6298)
+void tcp_sock_rtt_update(int sock, uint32_t rtt)
+{
+    NET_SOCKET *ts = &net_sockets[sock];
+    uint32_t diff;
+
+    tcp_stats[sock].rtt_samples++;
+    if (ts->srtt == 0)
+    {
+        ts->srtt = MAX(rtt, 1);
+        ts->rttvar = rtt / 2;
+    }
+    else
+    {
+        diff = rtt > ts->srtt ? rtt - ts->srtt : ts->srtt - rtt;
+        ts->rttvar = (3 * ts->rttvar + diff) / 4;
+        ts->srtt = MAX((7 * ts->srtt + rtt) / 8, 1);
+    }
+    ts->rto = MIN(MAX(ts->srtt + 4 * ts->rttvar, TCP_RTO_MIN), TCP_RTO_MAX);
+}
+
+// Return the current retransmission timeout in microseconds
+int tcp_sock_rto(int sock)
+{
+    NET_SOCKET *ts = &net_sockets[sock];
+
+    return (ts->rto ? ts->rto : TCP_RTO_INIT);
+}
+
+// Return the smoothed round-trip time in microseconds, 0 if not known
+uint32_t tcp_sock_srtt(int sock)
+{
+    return (net_sockets[sock].srtt);
+}
+
+// Change state of socket
+void tcp_new_state(int sock, BYTE news)
+{
+    NET_SOCKET *ts = &net_sockets[sock];
+
+    if ((display_mode & DISP_TCP_STATE) && ts->state < T_NUM_STATES && news < T_NUM_STATES)
+        printf("TCP socket %u state %s -> %s\n", sock,
+            tstate_strings[ts->state], tstate_strings[news]);
+    // Time in a state is counted from when the socket leaves CLOSED
+    if (ts->state == T_CLOSED)
+        tcp_stats[sock].state_ticks = ustime();
+    else
+        tcp_stats_time(&tcp_stats[sock], ts->state);
+    ts->state = news;
+    ts->ticks = ustime();
+    tcp_sock_active(sock, news != T_CLOSED && news != T_LISTEN);
+}
+
+// Get TCP statistics for a socket, or if -ve, the total for all sockets
+// The time in the current state is included; return 0 if invalid socket
+int tcp_get_stats(int sock, TCP_STATS *sp)
+{
+    TCP_STATS st;
+    DWORD *dp = (DWORD *)sp, *sp2 = (DWORD *)&st;
+    int i, n;
+
+    if (sock >= NUM_NET_SOCKETS)
+        return (0);
+    if (sock >= 0)
+    {
+        *sp = tcp_stats[sock];
+        tcp_stats_time(sp, net_sockets[sock].state);
+        return (1);
+    }
+    *sp = tcp_stats_total;
+    for (i = 0; i < NUM_NET_SOCKETS; i++)
+    {
+        st = tcp_stats[i];
+        tcp_stats_time(&st, net_sockets[i].sock_type == SOCK_STREAM ? net_sockets[i].state : T_CLOSED);
+        for (n = 0; n < offsetof(TCP_STATS, state_ticks) / sizeof(DWORD); n++)
+            dp[n] += sp2[n];
+    }
+    return (1);
+}
+
+// Add the time in the current state to the statistics
+void tcp_stats_time(TCP_STATS *sp, int state)
+{
+    uint32_t msec = (ustime() - sp->state_ticks) / 1000;
+
+    if (state != T_CLOSED && state < T_NUM_STATES)
+        sp->state_msec[state] += msec;
+    sp->state_ticks += msec * 1000;
+}
+
+// Add the statistics of a socket to the total when the connection ends,
+// then reset them
+void tcp_stats_end(int sock)
+{
+    TCP_STATS *sp = &tcp_stats[sock];
+    DWORD *dp = (DWORD *)&tcp_stats_total, *sp2 = (DWORD *)sp;
+
+    tcp_stats_time(sp, net_sockets[sock].state);
+    for (int n = 0; n < offsetof(TCP_STATS, state_ticks) / sizeof(DWORD); n++)
+        dp[n] += sp2[n];
+    memset(sp, 0, sizeof(TCP_STATS));
+    sp->state_ticks = ustime();
+}
+
+// If retry count has been exceeded, reset socket
+int tcp_sock_fail(int sock)
+{
+    NET_SOCKET *ts = &net_sockets[sock];
+    
+    if (++ts->tries >= TCP_TRIES)
+    {
+        tcp_sock_send(sock, TCP_RST, 0, 0);
+        tcp_new_state(sock, T_FAILED);
+        return (1);
+    }
+    return (0);
+}
+
+// Send a keepalive probe if the connection has been idle, with a sequence
+// number one below the next, so the remote sends an ACK (RFC 9293)
+// Reset the connection if the remote hasn't responded to the probes
+void tcp_sock_keepalive(int sock)
+{
+    NET_SOCKET *ts = &net_sockets[sock];
+    uint32_t usec = ts->keep_probes == 0 ?
+        (ts->keep_idle ? ts->keep_idle : TCP_KEEPIDLE_USEC) :
+        (ts->keep_intvl ? ts->keep_intvl : TCP_KEEPINTVL_USEC);
+
+    if (ustimeout(&ts->keep_ticks, usec))
+    {
+        if (ts->keep_probes++ >= (ts->keep_cnt ? ts->keep_cnt : TCP_KEEPCNT_DEFAULT))
+        {
+            tcp_sock_send(sock, TCP_RST, 0, 0);
+            tcp_new_state(sock, T_FAILED);
+        }
+        else
+        {
+            ts->seq--;
+            tcp_sock_send(sock, TCP_ACK, 0, 0);
+            ts->seq++;
+        }
+    }
+}
+
+// Probe the remote window if it is too small for the data waiting to be
+// sent, and there is nothing in flight that would prompt an update; the
+// probe is sent one below the next sequence number, so the remote ACKs it
+// with its current window; the time between probes doubles each time
+void tcp_sock_persist(int sock)
+{
+    NET_SOCKET *ts = &net_sockets[sock];
+    int waiting = ts->txdlen > 0 || tcp_sock_ring_unsent(sock) > 0 ||
+        (!ts->ring && !ts->close && ts->web_handler != 0);
+
+    if (ts->txq_count > 0 || !waiting || ts->rx_win >= (DWORD)MAX(ts->txdlen, 1))
+        ts->persist_usec = 0;
+    else if (ts->persist_usec == 0)
+    {
+        ts->persist_usec = tcp_sock_rto(sock);
+        ustimeout(&ts->persist_ticks, 0);
+    }
+    else if (ustimeout(&ts->persist_ticks, ts->persist_usec))
+    {
+        tcp_stats[sock].win_probes++;
+        ts->persist_usec = MIN(ts->persist_usec * 2, TCP_PERSIST_MAX_USEC);
+        ts->seq--;
+        tcp_sock_send(sock, TCP_ACK, 0, 0);
+        ts->seq++;
+    }
+}
+
+// Close a socket; if the connection has already ended, release the slot
+void tcp_sock_close(int sock)
+{
+    NET_SOCKET *ts = net_socket_ptr(sock);
+    
+    ts->close = 1;
+    if (ts->state == T_CLOSED)
+        ts->app_open = 0;
+}
+
+// Return the ring buffers of a connecting or connected socket, allocating
+// them if necessary; null if there are none free
+TCP_RING *tcp_sock_ring(int sock)
+{
+    NET_SOCKET *ts = &net_sockets[sock];
+    TCP_RING *rp;
+    
+    if (!ts->ring && ts->state != T_CLOSED && ts->state != T_LISTEN &&
+        (rp = tcp_ring_unused()) != 0)
+    {
+        rp->used = 1;
+        rp->tx_in = rp->tx_sent = rp->tx_out = rp->rx_in = rp->rx_out = 0;
+        ts->ring = rp;
+    }
+    return (ts->ring);
+}
+
+// Return unused ring buffers, null if none
+TCP_RING *tcp_ring_unused(void)
+{
+#if NUM_TCP_RINGS > 0
+    for (int i = 0; i < NUM_TCP_RINGS; i++)
+    {
+        if (!tcp_rings[i].used)
+            return (&tcp_rings[i]);
+    }
+#endif
+    return (0);
+}
+
+// Copy data into the Tx ring, return the byte count
+int tcp_sock_ring_put(int sock, const BYTE *data, int dlen)
+{
+    NET_SOCKET *ts = &net_sockets[sock];
+    TCP_RING *rp = ts->ring;
+    
+    if (!rp || (dlen = MIN(dlen, TCP_RING_SIZE - (int)(rp->tx_in - rp->tx_out))) <= 0)
+        return (0);
+    if (rp->tx_in == rp->tx_sent)
+        ts->cork_ticks = ustime();
+    tcp_ring_write(rp->txd, rp->tx_in, data, dlen);
+    rp->tx_in += dlen;
+    return (dlen);
+}
+
+// Add data from the Tx ring to the pending segment, return the byte count
+// The data is referenced, not copied, and released when acknowledged
+// A small amount is held back if corked, or by the Nagle algorithm
+int tcp_sock_ring_tx(int sock)
+{
+    NET_SOCKET *ts = &net_sockets[sock];
+    TCP_RING *rp = ts->ring;
+    int oset, n = tcp_sock_ring_unsent(sock);
+    
+    if (n <= 0 || (n < ts->mss && !ts->close &&
+        ((ts->cork && ustime() - ts->cork_ticks < TCP_CORK_USEC) ||
+         (ts->nagle && ts->txq_count > 0))))
+        return (0);
+    oset = rp->tx_sent & TCP_RING_MASK;
+    n = MIN(MIN(n, TCP_RING_SIZE - oset), tcp_sock_tx_room(sock));
+    if ((n = tcp_sock_add_tx_ref(sock, &rp->txd[oset], n, tcp_sock_ring_release)) > 0)
+        rp->tx_sent += n;
+    return (n);
+}
+
+// Return the number of bytes in the Tx ring that haven't been sent
+int tcp_sock_ring_unsent(int sock)
+{
+    TCP_RING *rp = net_sockets[sock].ring;
+    
+    return (rp ? (int)(rp->tx_in - rp->tx_sent) : 0);
+}
+
+// Free space in the Tx ring, when the data has been acknowledged
+void tcp_sock_ring_release(int sock, const BYTE *data, int dlen)
+{
+    TCP_RING *rp = net_sockets[sock].ring;
+    
+    if (rp)
+        rp->tx_out += dlen;
+}
+
+// Copy received data into the Rx ring, return the byte count
+// The window ensures there is always space for the data
+int tcp_sock_ring_rx(int sock, BYTE *data, int dlen)
+{
+    TCP_RING *rp = net_sockets[sock].ring;
+    
+    dlen = MIN(dlen, TCP_RING_SIZE - (int)(rp->rx_in - rp->rx_out));
+    tcp_ring_write(rp->rxd, rp->rx_in, data, dlen);
+    rp->rx_in += dlen;
+    return (dlen);
+}
+
+// Get data from the Rx ring, return the byte count
+// Queued data is moved into the ring, and the window is updated
+int tcp_sock_ring_get(int sock, BYTE *data, int maxlen)
+{
+    NET_SOCKET *ts = &net_sockets[sock];
+    TCP_RING *rp = ts->ring;
+    int n;
+    
+    if (!rp)
+        return (0);
+    if (ts->rx_read != ts->ack)
+        tcp_sock_rx_deliver(sock);
+    n = MIN(maxlen, (int)(rp->rx_in - rp->rx_out));
+    tcp_ring_read(rp->rxd, rp->rx_out, data, n);
+    rp->rx_out += n;
+    if (n > 0 && ts->state == T_ESTABLISHED)
+        tcp_sock_win_update(sock);
+    return (n);
+}
+
+// Copy data into a ring buffer, wrapping around at the end
+void tcp_ring_write(BYTE *ring, DWORD idx, const BYTE *data, int len)
+{
+    int oset = idx & TCP_RING_MASK, n = MIN(len, TCP_RING_SIZE - oset);
+    
+    memcpy(&ring[oset], data, n);
+    memcpy(ring, &data[n], len - n);
+}
+
+// Copy data from a ring buffer, wrapping around at the end
+void tcp_ring_read(const BYTE *ring, DWORD idx, BYTE *data, int len)
+{
+    int oset = idx & TCP_RING_MASK, n = MIN(len, TCP_RING_SIZE - oset);
+    
+    memcpy(data, &ring[oset], n);
+    memcpy(&data[n], ring, len - n);
+}
+
+// Return non-zero if more data may be received from the remote
+int tcp_sock_rx_open(int sock)
+{
+    int state = net_sockets[sock].state;
+    
+    return (state == T_SYN_SENT || state == T_SYN_RCVD || state == T_ESTABLISHED ||
+        state == T_FIN_WAIT_1 || state == T_FIN_WAIT_2);
+}
+
+// Return the poll events for a TCP socket
+// Rings aren't allocated here, only by send() or recv(), so a socket that
+// isn't using them still gives its data to the handler; until then, data
+// queued for recv() is readable, and a free ring is writable
+int tcp_sock_events(int sock)
+{
+    NET_SOCKET *ts = &net_sockets[sock];
+    TCP_RING *rp = ts->ring;
+    int events = 0;
+    
+    if (rp && ts->rx_read != ts->ack)
+        tcp_sock_rx_deliver(sock);
+    if (ts->state == T_LISTEN)
+        ts->accepting = 1;
+    if ((rp ? rp->rx_in != rp->rx_out : ts->client && !ts->web_handler && ts->rx_read != ts->ack) ||
+        (ts->state == T_LISTEN ? ts->acceptq_count > 0 : !tcp_sock_rx_open(sock)))
+        events |= POLLIN;
+    if (!ts->close && (rp ? rp->tx_in - rp->tx_out < TCP_RING_SIZE : tcp_ring_unused() != 0) &&
+        (ts->state == T_ESTABLISHED || ts->state == T_CLOSE_WAIT))
+        events |= POLLOUT;
+    if (ts->state == T_CLOSED || ts->state == T_FAILED)
+        events |= POLLHUP;
+    return (events);
+}
+
+// Send a TCP segment from a socket, with optional data
+int tcp_sock_send(int sock, BYTE flags, void *data, int dlen)
+{
+    NET_SOCKET *ts = &net_sockets[sock];
+
+    ts->ticks = (DWORD)ustime();
+    return(tcp_tx(sock, txbuff, ts->rem_mac, ts->rem_ip, ts->rem_port, ts->loc_port,
+        ts->seq, ts->ack, flags, data, dlen));
+}
+
+// Send a segment from the socket Tx queue, with the current ACK value
+int tcp_sock_send_seg(int sock, TCP_TXSEG *seg)
+{
+    NET_SOCKET *ts = &net_sockets[sock];
+
+    // Headers are before the data, so shorter if there is no timestamp option
+    ts->ticks = (DWORD)ustime();
+    return(tcp_tx2(sock, ts->ts_ok ? seg->frame : &seg->frame[TCP_TSOPT_LEN], ts->rem_mac, ts->rem_ip, ts->rem_port, ts->loc_port,
+        seg->seq, ts->ack, seg->flags, 0, seg->dlen - seg->reflen, seg->ref, seg->reflen, seg->csum));
+}
+
+// Send a TCP 'reset' to client
+int tcp_send_reset(int sock, MACADDR mac, IPADDR dip, WORD remport, WORD locport, DWORD seq, DWORD ack)
+{
+    tcp_tx(sock, txbuff, mac, dip, remport, locport, seq, ack, TCP_RST+TCP_ACK, 0, 0);
+    return (1);
 }
 
 // Send a TCP segment
 int tcp_tx(int sock, BYTE *buff, MACADDR mac, IPADDR dip, WORD remport, WORD locport, DWORD seq, DWORD ack,
     BYTE flags, void *data, int dlen)
 {
-    int tlen = tcp_add_hdr_data(&buff[IP_DATA_OFFSET], dip, remport, locport, seq, ack, flags, data, dlen);
+    return (tcp_tx2(sock, buff, mac, dip, remport, locport, seq, ack, flags, data, dlen, 0, 0, 0));
+}
+
+// Send a TCP segment, with optional referenced data after the buffer data
+// If the data pointer is null, the data is already in the buffer, and the
+// checksum of it (and any referenced data) is given
+int tcp_tx2(int sock, BYTE *buff, MACADDR mac, IPADDR dip, WORD remport, WORD locport, DWORD seq, DWORD ack,
+    BYTE flags, void *data, int dlen, const BYTE *ref, int reflen, DWORD dsum)
+{
+    int tlen = tcp_add_hdr_data(sock, &buff[IP_DATA_OFFSET], dip, remport, locport, seq, ack, flags,
+        data, dlen, reflen, dsum);
     int len = ip_add_eth(buff, mac, my_mac, PCOL_IP);
 
-    len += ip_add_hdr(&buff[len], dip, PTCP, tlen) + tlen;
+    // If socket, the IP header template has been set by the TCP header
+    if (sock >= 0)
+        len += ip_add_hdr_tmpl(&buff[len], &tcp_tmpls[sock].ip, tlen + reflen) + tlen;
+    else
+        len += ip_add_hdr(&buff[len], dip, PTCP, tlen + reflen) + tlen;
+    if (sock >= 0)
+    {
+        tcp_stats[sock].segs_out++;
+        tcp_stats[sock].bytes_out += MAX(dlen, 0) + reflen;
+    }
     if (display_mode & DISP_TCP)
     {
         if (sock >= 0)
             printf("Tx%d ", sock);
         else
             printf("Tx  ");
-        tcp_print_hdr(sock, buff, len);
+        tcp_print_hdr(sock, buff, len + reflen);
     }
-    return (ip_tx_eth(buff, len));
+    return (reflen > 0 ? ip_tx_eth2(buff, len, ref, reflen) : ip_tx_eth(buff, len));
 }
 
-// Add TCP header and optional data to buffer
-int tcp_add_hdr_data(BYTE *buff, IPADDR dip, WORD remport, WORD locport,
-    DWORD seq, DWORD ack, BYTE flags, void *data, int dlen)
+// Add TCP header and optional data to buffer, return length in buffer
+// Data is copied and checksummed in one pass; if there is no data pointer,
+// the checksum is given for data in the buffer, and any referenced data
+// that will follow it
+int tcp_add_hdr_data(int sock, BYTE *buff, IPADDR dip, WORD remport, WORD locport,
+    DWORD seq, DWORD ack, BYTE flags, void *data, int dlen, int reflen, DWORD dsum)
 {
     TCPHDR *tcp = (TCPHDR *)buff;
-    WORD hlen = sizeof(TCPHDR), *wp = (WORD *)&buff[sizeof(TCPHDR)], len;
+    NET_SOCKET *ts = sock >= 0 ? &net_sockets[sock] : 0;
+    TCP_HDR_TMPL *tp = ts ? tcp_sock_tmpl(sock, dip, remport, locport) : 0;
+    WORD hlen = sizeof(TCPHDR), len;
+    int win = TCP_WINDOW;
+    PHDR tph = {.z=0, .pcol=PTCP};
 
-    if (flags & TCP_SYN)
-    {
-        *wp++ = 0x0402;
-        *wp = htons(TCP_MSS);
-        hlen += 4;
-    }
-    tcp->sport = htons(locport);
-    tcp->dport = htons(remport);
+    hlen += tcp_add_opts(sock, &buff[sizeof(TCPHDR)], flags, dlen);
+    tcp->sport = tp ? tp->sport : htons(locport);
+    tcp->dport = tp ? tp->dport : htons(remport);
     tcp->hlen = (BYTE)(hlen << 2);
     tcp->flags = flags;
     tcp->check = tcp->urgent = 0;
-    tcp->window = htons(TCP_WINDOW);
+    // Advertise the free space in the receive buffer, scaled if not SYN
+    // Any delayed ACK is sent with this segment
+    if (ts)
+    {
+        if (flags & TCP_ACK)
+            ts->ack_pending = 0;
+        if ((win = tcp_sock_rx_win(sock)) == 0 && ts->rx_win_sent != 0)
+            tcp_stats[sock].zero_wins_tx++;
+        ts->rx_win_sent = win;
+        if (!(flags & TCP_SYN) && ts->wscale_ok)
+            win >>= TCP_WSCALE;
+    }
+    tcp->window = htons(MIN(win, 0xffff));
     tcp->seq = htonl(seq);
     tcp->ack = htonl(ack);
-    len = hlen + ip_add_data(&buff[hlen], data, dlen);
-    tcp->check = tcp_checksum(tcp, my_ip, dip, len);
+    if (data && dlen > 0)
+        dsum = csum_copy(&buff[hlen], data, dlen);
+    len = hlen + dlen;
+    // Template has the sum of the fixed fields, so add the rest of the header
+    if (tp)
+        tcp->check = ~csum_fold(dsum + tp->sum + htons(len + reflen) +
+            csum_data(&tcp->seq, hlen - 4));
+    else
+    {
+        tph.len = htons(len + reflen);
+        IP_CPY(tph.sip, my_ip);
+        IP_CPY(tph.dip, dip);
+        tcp->check = ~csum_fold(dsum + csum_data(tcp, hlen) + csum_data(&tph, sizeof(tph)));
+    }
     return (len);
 }
 
-// Return TCP checksum, given segment (TCP header + data) length.
-WORD tcp_checksum(TCPHDR *tcp, IPADDR sip, IPADDR dip, int tlen)
+// Return the header template for a socket, remaking it if the
+// addresses or ports differ, e.g. a SYN ACK from a listening socket
+TCP_HDR_TMPL *tcp_sock_tmpl(int sock, IPADDR dip, WORD remport, WORD locport)
 {
-    PHDR tph = {.len = htons(tlen), .z=0, .pcol=PTCP};
-    DWORD sum = checksum(tcp, tlen);
+    TCP_HDR_TMPL *tp = &tcp_tmpls[sock];
+    PHDR tph = {.len=0, .z=0, .pcol=PTCP};
 
-    IP_CPY(tph.sip, sip);
-    IP_CPY(tph.dip, dip);
-    sum += checksum(&tph, sizeof(tph));
-    return (WORD)(sum + (sum >> 16));
+    if (!tp->ip.vhl || !IP_CMP(tp->ip.dip, dip) || !IP_CMP(tp->ip.sip, my_ip) ||
+        tp->sport != htons(locport) || tp->dport != htons(remport))
+    {
+        ip_make_tmpl(&tp->ip, dip, PTCP);
+        tp->sport = htons(locport);
+        tp->dport = htons(remport);
+        IP_CPY(tph.sip, my_ip);
+        IP_CPY(tph.dip, dip);
+        tp->sum = csum_data(&tph, sizeof(tph)) + tp->sport + tp->dport;
+    }
+    return (tp);
+}
+
+// Add TCP options to buffer, return length (a multiple of 4 bytes)
+// SACK blocks are only sent in segments without data, since the
+// queued data segments have no space for options
+int tcp_add_opts(int sock, BYTE *buff, BYTE flags, int dlen)
+{
+    NET_SOCKET *ts = sock >= 0 ? &net_sockets[sock] : 0;
+    DWORD blocks[TCP_RXQ_SEGS * 2];
+    int i, n = 0, nblocks;
+
+    if (flags & TCP_SYN)
+    {
+        buff[n++] = TCP_OPT_MSS;
+        buff[n++] = 4;
+        buff[n++] = (BYTE)(TCP_MSS >> 8);
+        buff[n++] = (BYTE)TCP_MSS;
+        if (ts && (ts->sack_ok || ts->state == T_SYN_SENT))
+        {
+            buff[n++] = TCP_OPT_NOP;
+            buff[n++] = TCP_OPT_NOP;
+            buff[n++] = TCP_OPT_SACKOK;
+            buff[n++] = 2;
+        }
+        if (ts && (ts->wscale_ok || ts->state == T_SYN_SENT))
+        {
+            buff[n++] = TCP_OPT_NOP;
+            buff[n++] = TCP_OPT_WSCALE;
+            buff[n++] = 3;
+            buff[n++] = TCP_WSCALE;
+        }
+    }
+    // Timestamps are offered in SYN, then sent in every segment if agreed
+    if (ts && !(flags & TCP_RST) && (ts->ts_ok || (ts->state == T_SYN_SENT && (flags & TCP_SYN))))
+    {
+        buff[n++] = TCP_OPT_NOP;
+        buff[n++] = TCP_OPT_NOP;
+        buff[n++] = TCP_OPT_TSTAMP;
+        buff[n++] = 10;
+        TCP_OPT_PUT32(&buff[n], tcp_ts_clock());
+        TCP_OPT_PUT32(&buff[n + 4], ts->ts_ok ? ts->ts_recent : 0);
+        n += 8;
+    }
+    if (!(flags & TCP_SYN) && ts && ts->sack_ok && dlen <= 0 &&
+        (nblocks = tcp_sock_rxq_blocks(sock, blocks)) > 0)
+    {
+        buff[n++] = TCP_OPT_NOP;
+        buff[n++] = TCP_OPT_NOP;
+        buff[n++] = TCP_OPT_SACK;
+        buff[n++] = 2 + nblocks * 8;
+        for (i = 0; i < nblocks; i++)
+        {
+            TCP_OPT_PUT32(&buff[n], blocks[i * 2]);
+            TCP_OPT_PUT32(&buff[n + 4], blocks[i * 2 + 1]);
+            n += 8;
+        }
+    }
+    return (n);
 }
 
-// Calculate checksum given data block
-WORD checksum(void *data, int len)
+// Get SACK blocks (start & end sequence numbers) for the out-of-sequence
+// data, merging adjacent segments; return number of blocks
+// The first block must contain the most recently received data
+int tcp_sock_rxq_blocks(int sock, DWORD *blocks)
 {
-    WORD *buff = data;
-    DWORD cksum = 0;
-    while (len > 1)
+    NET_SOCKET *ts = &net_sockets[sock];
+    TCP_RXSEG *rxs;
+    DWORD temp;
+    int i, n = 0, first = 0;
+
+    for (i = 0; i < ts->rxq_count; i++)
     {
-        cksum += *buff++;
-        len -= sizeof(WORD);
+        rxs = &ts->rxq[i];
+        if ((int)(rxs->seq - ts->ack) <= 0)
+            continue;
+        if (n > 0 && (int)(rxs->seq - blocks[n * 2 - 1]) <= 0)
+        {
+            if ((int)(rxs->seq + rxs->len - blocks[n * 2 - 1]) > 0)
+                blocks[n * 2 - 1] = rxs->seq + rxs->len;
+        }
+        else
+        {
+            blocks[n * 2] = rxs->seq;
+            blocks[n * 2 + 1] = rxs->seq + rxs->len;
+            n++;
+        }
+        if ((int)(ts->sack_seq - rxs->seq) >= 0 && (int)(ts->sack_seq - rxs->seq - rxs->len) < 0)
+            first = n - 1;
     }
-    if (len)
-        cksum += *(BYTE *)buff;
-    cksum = (cksum >> 16) + (cksum & 0xffff);
-    cksum += (cksum >> 16);
-    return (WORD)(~cksum);
+    for (i = first; i > 0; i--)
+    {
+        temp = blocks[i * 2];
+        blocks[i * 2] = blocks[i * 2 - 2];
+        blocks[i * 2 - 2] = temp;
+        temp = blocks[i * 2 + 1];
+        blocks[i * 2 + 1] = blocks[i * 2 - 1];
+        blocks[i * 2 - 1] = temp;
+    }
+    return (MIN(n, TCP_SACK_BLOCKS));
+}
+
+// Return TCP checksum, given segment (TCP header + data) length.
+WORD tcp_checksum(TCPHDR *tcp, IPADDR sip, IPADDR dip, int tlen)
+{
+    PHDR tph = {.len = htons(tlen), .z=0, .pcol=PTCP};
+
+    IP_CPY(tph.sip, sip);
+    IP_CPY(tph.dip, dip);
+    return ((WORD)~csum_fold(csum_data(tcp, tlen) + csum_data(&tph, sizeof(tph))));
 }
 
 // Display TCP header
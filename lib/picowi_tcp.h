@@ -22,13 +22,63 @@
 
 #pragma pack(1)
 
-#define TCP_NUM_SOCKETS 5
+#define TCP_NUM_SOCKETS NUM_NET_SOCKETS
 
 #define TCP_MSS         1460
-#define TCP_WINDOW      (1 * TCP_MSS)
-#define TCP_CHECK_USEC  10000000
+#define TCP_WINDOW      (TCP_RXQ_SEGS * TCP_MSS)    // Receive buffer size
+#ifndef TCP_WSCALE
+#define TCP_WSCALE      0       // Window scale shift, if TCP_WINDOW > 65535
+#endif
+#if (TCP_WINDOW >> TCP_WSCALE) > 0xffff
+#error "TCP_WSCALE too small for TCP_WINDOW"
+#endif
+#define TCP_TX_MAXDATA  (TCP_MSS - TCP_DATA_OFFSET) // Max data in Tx segment
+// Max data saved in a receive queue buffer, leaving a byte for the Web
+// request handler to add a null terminator
+#define TCP_RXSEG_MAXLEN (NET_BUFF_SIZE - 1)
+#define TCP_MSS_DEFAULT 536     // Remote MSS if not given in SYN (RFC 9293)
+// Initial congestion window (RFC 5681), it can't exceed the Tx queue size
+#define TCP_INIT_CWND(mss)  MIN(4 * (mss), MAX(2 * (mss), 4380))
+#define TCP_MAX_CWND(mss)   (TCP_TXQ_SEGS * (mss))
+// Keepalive defaults, for an idle connection
+#ifndef TCP_KEEPIDLE_USEC
+#define TCP_KEEPIDLE_USEC  60000000 // Idle time before first probe
+#endif
+#ifndef TCP_KEEPINTVL_USEC
+#define TCP_KEEPINTVL_USEC 10000000 // Time between probes
+#endif
+#ifndef TCP_KEEPCNT_DEFAULT
+#define TCP_KEEPCNT_DEFAULT 5       // Unanswered probes before reset
+#endif
+#define TCP_KEEP_MAXSEC 2000        // Max keepalive time, given 32-bit usec timer
 #define TCP_RETRY_USEC  2000000
+#define TCP_RTO_INIT    1000000     // Initial retransmission timeout
+#define TCP_RTO_MIN     200000      // Min retransmission timeout
+#define TCP_RTO_MAX     60000000    // Max retransmission timeout, after backoff
+#ifndef TCP_PERSIST_MAX_USEC
+#define TCP_PERSIST_MAX_USEC 60000000   // Max time between window probes
+#endif
+#define TCP_EPHEM_MIN   49152       // Start of ephemeral port range for clients
 #define TCP_TRIES       5
+#define TCP_DUPACKS     3       // Duplicate ACKs to trigger fast retransmit
+#define TCP_SACK_BLOCKS 3       // Max number of SACK blocks in an ACK
+#define TCP_DELACK_USEC 40000   // Max delay before ACKing received data
+#define TCP_DELACK_SEGS 2       // Number of segments to receive before ACK
+#define TCP_CORK_USEC   200000  // Max time a corked partial segment is held
+#ifndef TCP_SYNQ_LEN
+#define TCP_SYNQ_LEN    8       // Max half-open connections, before SYN cookies
+#endif
+#define TCP_COOKIE_USHIFT 26    // Time count for SYN cookies, approx 67 sec
+#ifndef TCP_TIMEWAIT_LEN
+#define TCP_TIMEWAIT_LEN 8      // Max connections kept in TIME_WAIT
+#endif
+#define TCP_TIMEWAIT_USEC 60000000  // Time in TIME_WAIT (2 * MSL)
+#define TCP_RING_MASK   (TCP_RING_SIZE - 1)
+#if TCP_RING_SIZE & TCP_RING_MASK
+#error "TCP_RING_SIZE must be a power of 2"
+#elif TCP_RING_SIZE < TCP_WINDOW
+#error "TCP_RING_SIZE must be at least TCP_WINDOW"
+#endif
 
 /* Well-known TCP port numbers */
 #define ECHOPORT    7       /* Echo */
@@ -57,6 +107,23 @@ typedef enum {
     T_NUM_STATES
 } TCP_STATES;
 
+// TCP statistics, for a socket, or the total for all sockets
+// The counters are all DWORD values, so they can be added as an array
+typedef struct {
+    DWORD segs_in, segs_out;    // Segments received & sent
+    DWORD bytes_in, bytes_out;  // Data bytes received & sent, including resends
+    DWORD retransmits;          // Segments resent
+    DWORD dup_acks;             // Duplicate ACKs received
+    DWORD ooo_segs, ooo_drops;  // Out-of-sequence segments received, and discarded
+    DWORD zero_wins_rx;         // Times the remote window has closed
+    DWORD zero_wins_tx;         // Times a zero window has been sent
+    DWORD win_probes;           // Probes sent while the remote window is closed
+    DWORD rtt_samples;          // Round-trip time measurements
+    DWORD paws_drops;           // Segments discarded with old timestamps
+    DWORD state_msec[T_NUM_STATES]; // Time in each state, not including CLOSED
+    uint32_t state_ticks;       // Time of last state change
+} TCP_STATS;
+
 #define TCP_STATE_STRS "CLOSED", "LISTEN", "SYN_SENT", "SYN_RECEIVED", \
     "ESTABLISHED", "FIN_WAIT_1", "FIN_WAIT_2", "CLOSE_WAIT", "CLOSING", \
     "LAST_ACK", "TIME_WAIT", "FINISHED", "FAILED", ""
@@ -76,6 +143,8 @@ typedef struct tcph
 } TCPHDR;
 
 #define TCP_DATA_OFFSET (sizeof(ETHERHDR) + sizeof(IPHDR) + sizeof(TCPHDR))
+// Data in a Tx segment frame is after space for the timestamp option
+#define TCP_SEG_DATA_OFFSET (TCP_DATA_OFFSET + TCP_TSOPT_LEN)
 
 #define TCP_FIN     0x01    /* Option flags: no more data */
 #define TCP_SYN     0x02    /*           sync sequence nums */
@@ -84,27 +153,147 @@ typedef struct tcph
 #define TCP_ACK     0x10    /*           acknowledgement */
 #define TCP_URGE    0x20    /*           urgent */
 
+#define TCP_OPT_END     0   /* Option kinds: end of list */
+#define TCP_OPT_NOP     1   /*           no-operation (padding) */
+#define TCP_OPT_MSS     2   /*           maximum segment size */
+#define TCP_OPT_WSCALE  3   /*           window scale */
+#define TCP_OPT_SACKOK  4   /*           SACK permitted */
+#define TCP_OPT_SACK    5   /*           SACK blocks */
+#define TCP_OPT_TSTAMP  8   /*           timestamps */
+#define TCP_TSOPT_LEN   12  // Length of timestamp option, with padding
+#define TCP_PAWS_IDLE_MSEC 2073600000  // Remote timestamp expires after 24 days
+
+// Get & put big-endian 32-bit option values, that may not be aligned
+#define TCP_OPT_GET32(p) (((DWORD)(p)[0]<<24) | ((DWORD)(p)[1]<<16) | ((DWORD)(p)[2]<<8) | (p)[3])
+#define TCP_OPT_PUT32(p, v) {(p)[0]=(BYTE)((v)>>24); (p)[1]=(BYTE)((v)>>16); \
+                             (p)[2]=(BYTE)((v)>>8); (p)[3]=(BYTE)(v);}
+
 #pragma pack()
 
+// Half-open connection in the SYN queue, awaiting the ACK of the SYN ACK
+// Only the connection is stored, not a full socket
+typedef struct {
+    IPADDR rem_ip;
+    MACADDR rem_mac;
+    WORD rem_port, loc_port;    // Local port is zero if entry is unused
+    DWORD iss, irs;             // Initial send & receive sequence numbers
+    DWORD ts_recent;
+    uint32_t ticks;             // Time SYN ACK was sent
+    WORD mss;
+    BYTE sack_ok, wscale_ok, wscale_tx, ts_ok;
+    BYTE tries;                 // Number of resends, or non-zero if from cookie
+} TCP_SYNREQ;
+
+// Connection in TIME_WAIT, after its socket has been freed
+typedef struct {
+    IPADDR rem_ip;
+    WORD rem_port, loc_port;    // Local port is zero if entry is unused
+    DWORD seq, ack;             // Sequence numbers for ACK of a late segment
+    uint32_t ticks;             // Time when TIME_WAIT started
+} TCP_TIMEWAIT;
+
+// IP & TCP header template for a connection, made once when it starts
+// so that only the fields that change are added for each segment
+typedef struct {
+    IPHDR ip;                   // IP header with zero ident & length
+    WORD sport, dport;          // Ports, in network byte order
+    DWORD sum;                  // Checksum of pseudo-header (no length) & ports
+} TCP_HDR_TMPL;
+
 void tcp_init(void);
 int tcp_sock_unused(void);
 void tcp_sock_set(int sock, net_handler_t handler, IPADDR remip, WORD remport, WORD locport);
 int tcp_server_event_handler(EVENT_INFO *eip);
-int tcp_sock_match(IPADDR remip, WORD remport, WORD locport, BYTE flags);
+int tcp_rx(EVENT_INFO *eip);
+int tcp_sock_connect(int sock, IPADDR remip, WORD remport);
+void tcp_sock_syn(int sock);
+WORD tcp_ephem_port(void);
+void tcp_sock_set_handler(int sock, web_handler_t handler);
+int tcp_sock_match(IPADDR remip, WORD remport, WORD locport);
+int tcp_listen_rx(int sock, BYTE *data, int len);
+TCP_SYNREQ *tcp_synq_find(IPADDR remip, WORD remport, WORD locport);
+void tcp_synq_send(int sock, TCP_SYNREQ *req);
+void tcp_synq_poll(void);
+DWORD tcp_syn_cookie(IPADDR remip, WORD remport, WORD locport, DWORD irs, DWORD t, int idx);
+int tcp_syn_cookie_check(int sock, TCP_SYNREQ *req);
+int tcp_sock_new_conn(int lsock, TCP_SYNREQ *req);
+int tcp_sock_accept(int lsock);
+void tcp_sock_unqueue(int sock);
+void tcp_timewait_add(int sock);
+int tcp_timewait_rx(BYTE *data);
 void tcp_socks_poll(void);
+void tcp_sock_active(int sock, bool active);
 int tcp_sock_rx(int sock, BYTE *data, int len);
 void tcp_sock_clear(int sock);
 int tcp_get_resp(int sock, BYTE *data, int dlen);
+int tcp_sock_rx_data(int sock, BYTE *data);
+int tcp_sock_rxq_add(int sock, DWORD seq, BYTE *data, int len);
+int tcp_sock_rx_deliver(int sock);
+void tcp_sock_rx_closing(int sock, BYTE *data, BYTE rflags);
+int tcp_sock_rx_fin(int sock, BYTE rflags);
+void tcp_sock_rx_old(int sock, BYTE rflags);
+int tcp_sock_rx_win(int sock);
+void tcp_sock_win_update(int sock);
+void tcp_sock_delack(int sock, bool now);
 int tcp_sock_add_tx_data(int sock, BYTE *data, int dlen);
+int tcp_sock_add_tx_ref(int sock, const BYTE *data, int dlen, tx_release_t release);
+int tcp_sock_tx_space(int sock);
+int tcp_sock_tx_win(int sock);
+int tcp_sock_txq_free(int sock);
+void tcp_sock_tx_more(int sock);
+int tcp_sock_tx_hold(int sock);
+int tcp_sock_tx_flush(int sock);
+int tcp_sock_tx_room(int sock);
+int tcp_sock_queue(int sock, BYTE flags);
+int tcp_sock_ack(int sock, BYTE rflags);
+void tcp_sock_seg_free(int sock, TCP_TXSEG *seg);
+void tcp_sock_cwnd_init(int sock);
+void tcp_sock_cwnd_ack(int sock, int n);
+void tcp_sock_cwnd_loss(int sock, bool timeout);
+void tcp_sock_retry(int sock);
+void tcp_sock_resend(int sock);
+void tcp_sock_resend_more(int sock);
+void tcp_sock_resend_lost(int sock);
+int tcp_sock_rx_opts(int sock, BYTE *data);
+DWORD tcp_ts_clock(void);
+void tcp_sock_sack(int sock, DWORD left, DWORD right);
+DWORD tcp_sock_unacked(int sock);
+void tcp_sock_rtt_start(int sock, DWORD seq);
+void tcp_sock_rtt_ack(int sock);
+void tcp_sock_rtt_update(int sock, uint32_t rtt);
+int tcp_sock_rto(int sock);
+uint32_t tcp_sock_srtt(int sock);
 void tcp_new_state(int sock, BYTE news);
+int tcp_get_stats(int sock, TCP_STATS *sp);
+void tcp_stats_time(TCP_STATS *sp, int state);
+void tcp_stats_end(int sock);
 int tcp_sock_fail(int sock);
+void tcp_sock_keepalive(int sock);
+void tcp_sock_persist(int sock);
 void tcp_sock_close(int sock);
+TCP_RING *tcp_sock_ring(int sock);
+TCP_RING *tcp_ring_unused(void);
+int tcp_sock_ring_put(int sock, const BYTE *data, int dlen);
+int tcp_sock_ring_tx(int sock);
+int tcp_sock_ring_unsent(int sock);
+void tcp_sock_ring_release(int sock, const BYTE *data, int dlen);
+int tcp_sock_ring_rx(int sock, BYTE *data, int dlen);
+int tcp_sock_ring_get(int sock, BYTE *data, int maxlen);
+void tcp_ring_write(BYTE *ring, DWORD idx, const BYTE *data, int len);
+void tcp_ring_read(const BYTE *ring, DWORD idx, BYTE *data, int len);
+int tcp_sock_rx_ready(int sock);
+int tcp_sock_rx_open(int sock);
+int tcp_sock_events(int sock);
 int tcp_sock_send(int sock, BYTE flags, void *data, int dlen);
+int tcp_sock_send_seg(int sock, TCP_TXSEG *seg);
 int tcp_send_reset(int sock, MACADDR mac, IPADDR dip, WORD remport, WORD locport, DWORD seq, DWORD ack);
 int tcp_tx(int sock, BYTE *buff, MACADDR mac, IPADDR dip, WORD remport, WORD locport, DWORD seq, DWORD ack, BYTE flags, void *data, int dlen);
-int tcp_add_hdr_data(BYTE *buff, IPADDR dip, WORD remport, WORD locport, DWORD seq, DWORD ack, BYTE flags, void *data, int dlen);
+int tcp_tx2(int sock, BYTE *buff, MACADDR mac, IPADDR dip, WORD remport, WORD locport, DWORD seq, DWORD ack, BYTE flags, void *data, int dlen, const BYTE *ref, int reflen, DWORD dsum);
+TCP_HDR_TMPL *tcp_sock_tmpl(int sock, IPADDR dip, WORD remport, WORD locport);
+int tcp_add_hdr_data(int sock, BYTE *buff, IPADDR dip, WORD remport, WORD locport, DWORD seq, DWORD ack, BYTE flags, void *data, int dlen, int reflen, DWORD dsum);
+int tcp_add_opts(int sock, BYTE *buff, BYTE flags, int dlen);
+int tcp_sock_rxq_blocks(int sock, DWORD *blocks);
 WORD tcp_checksum(TCPHDR *tcp, IPADDR sip, IPADDR dip, int tlen);
-WORD checksum(void *data, int len);
 void tcp_print_hdr(int sock, BYTE *data, int dlen);
 
 // EOF
@@ -30,6 +30,7 @@
 #include "picowi_ip.h"
 #include "picowi_net.h"
 #include "picowi_udp.h"
+#include "picowi_csum.h"
 
 extern int display_mode;
 
@@ -44,26 +45,33 @@ extern IPADDR my_ip;            // My IP address, and DNS server
 int udp_event_handler(EVENT_INFO *eip)
 {
     IPHDR *ip = (IPHDR *)&eip->data[sizeof(ETHERHDR)];
-    UDPHDR *udp = (UDPHDR *)&eip->data[sizeof(ETHERHDR) + sizeof(IPHDR)];
-    NET_SOCKET *usp;
-    int sock;
 
     if (eip->chan == SDPCM_CHAN_DATA &&
         ip->pcol == PUDP &&
         ip_check_frame(eip->data, eip->dlen) &&
         eip->dlen >= sizeof(ETHERHDR) + sizeof(IPHDR) + sizeof(UDPHDR))
     {
-        if (display_mode & DISP_UDP)
-        {
-            printf("Rx ");
-            udp_print_hdr(eip->data, eip->dlen);
-        }
-        if ((sock = udp_sock_match(ip->sip, htons(udp->sport), htons(udp->dport))) >= 0)
-        {
-            printf("Rx SOCK %d\n", sock);
-            usp = &net_sockets[sock];
-            return (udp_sock_rx(usp, eip->data, eip->dlen));
-        }
+        return (udp_rx(eip->data, eip->dlen));
+    }
+    return (0);
+}
+
+// Receive UDP datagram, that has been checked, pass it to the matching socket
+int udp_rx(BYTE *data, int dlen)
+{
+    IPHDR *ip = (IPHDR *)&data[sizeof(ETHERHDR)];
+    UDPHDR *udp = (UDPHDR *)&data[sizeof(ETHERHDR) + sizeof(IPHDR)];
+    int sock;
+
+    if (display_mode & DISP_UDP)
+    {
+        printf("Rx ");
+        udp_print_hdr(data, dlen);
+    }
+    if ((sock = udp_sock_match(ip->sip, htons(udp->sport), htons(udp->dport))) >= 0)
+    {
+        printf("Rx SOCK %d\n", sock);
+        return (udp_sock_rx(&net_sockets[sock], data, dlen));
     }
     return (0);
 }
@@ -73,7 +81,8 @@ int udp_sock_unused(void)
 {
     for (int i=0; i<NUM_NET_SOCKETS; i++)
     {
-        if (net_sockets[i].loc_port == 0 && net_sockets[i].rem_port == 0)
+        if (net_sockets[i].loc_port == 0 && net_sockets[i].rem_port == 0 &&
+            !net_sockets[i].app_open)
             return (i);
     }
     return (-1);
@@ -89,6 +98,7 @@ void udp_sock_set(int sock, net_handler_t handler, IPADDR remip, WORD remport, W
     usp->loc_port = locport;
     usp->rem_port = remport;
     usp->sock_handler = handler;
+    net_sock_hash(sock);
 }
 
 // Initialise a UDP socket
@@ -108,16 +118,7 @@ NET_SOCKET *udp_sock_init(net_handler_t handler, IPADDR remip, WORD remport, WOR
 // Find matching socket for incoming UDP datagram, return -ve if none
 int udp_sock_match(IPADDR remip, WORD remport, WORD locport)
 {
-    NET_SOCKET *usp = 0;
-    int i;
-
-    for (i=0; i<NUM_NET_SOCKETS; i++)
-    {
-        usp = &net_sockets[i];
-        if (locport == usp->loc_port)
-            return (i);
-    }
-    return (-1);
+    return (net_sock_find(SOCK_DGRAM, remip, remport, locport));
 }
 
 // Receive incoming UDP datagram
@@ -158,14 +159,17 @@ int udp_add_hdr_data(BYTE *buff, WORD sport, WORD dport, void *data, int dlen)
     UDPHDR *udp = (UDPHDR *)buff;
     IPHDR *ip = (IPHDR *)(buff - sizeof(IPHDR));
     WORD len = sizeof(UDPHDR), check;
+    DWORD dsum;
     PHDR ph;
 
     udp->sport = htons(sport);
     udp->dport = htons(dport);
     udp->len = htons(sizeof(UDPHDR) + dlen);
     udp->check = 0;
-    len += ip_add_data(&buff[sizeof(UDPHDR)], data, dlen);
-    check = add_csum(0, udp, len);
+    // Copy and checksum the data in one pass, unless it is already in place
+    dsum = data ? csum_copy(&buff[len], data, dlen) : csum_data(&buff[len], dlen);
+    len += dlen;
+    check = add_csum(csum_fold(dsum), udp, sizeof(UDPHDR));
     IP_CPY(ph.sip, ip->sip);
     IP_CPY(ph.dip, ip->dip);
     ph.z = 0;
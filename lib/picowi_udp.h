@@ -21,6 +21,7 @@
 // SOFTWARE.
 
 int udp_event_handler(EVENT_INFO *eip);
+int udp_rx(BYTE *data, int dlen);
 int udp_sock_unused(void);
 void udp_sock_set(int sock, net_handler_t handler, IPADDR remip, WORD remport, WORD locport);
 NET_SOCKET *udp_sock_init(net_handler_t handler, IPADDR remip, WORD remport, WORD locport);
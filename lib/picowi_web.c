@@ -79,21 +79,32 @@ int web_resp_add_str(int sock, char *str)
     return (tcp_sock_add_tx_data(sock, (BYTE *)str, strlen(str)));
 }
 
+// Add a reference to data in an HTTP response, so it is sent without copying
+// The data must be unchanged until the release function is called
+int web_resp_add_ref(int sock, const BYTE *data, int dlen, tx_release_t release)
+{
+    return (tcp_sock_add_tx_ref(sock, data, dlen, release));
+}
+
 // Add content length string to an HTTP response
 int web_resp_add_content_len(int sock, int n)
 {
-    NET_SOCKET *ts = &net_sockets[sock];
-    int i = sprintf((char *)&ts->txbuff[TCP_DATA_OFFSET + ts->txdlen], HTTP_CONTENT_LENGTH, n);
-    ts->txdlen += i;
-    return (i);
+    char temps[30];
+    
+    sprintf(temps, HTTP_CONTENT_LENGTH, n);
+    return (web_resp_add_str(sock, temps));
+}
+
+// Return the space for more data in the current response segment
+int web_resp_space(int sock)
+{
+    return (tcp_sock_tx_room(sock));
 }
 
 // Send a Web response
 int web_resp_send(int sock)
 {
-    NET_SOCKET *ts = net_socket_ptr(sock);
-
-    return(tcp_sock_send(sock, TCP_ACK, 0, ts->txdlen));
+    return(tcp_sock_queue(sock, TCP_ACK));
 }
 
 // EOF
@@ -30,6 +30,7 @@
 #define HTTP_CONTENT_JPEG   "Content-Type: image/jpeg\r\n"
 #define HTTP_CONTENT_TEXT   "Content-Type: text/plain\r\n"
 #define HTTP_CONTENT_BINARY "Content-Type: application/octet-stream\r\n"
+#define HTTP_CONTENT_JSON   "Content-Type: application/json\r\n"
 #define HTTP_CONTENT_LENGTH "Content-Length: %d\r\n"
 #define HTTP_ORIGIN_ANY     "Access-Control-Allow-Origin: *\r\n"
 #define HTTP_TRANSFER_CHUNKED "Transfer-Encoding: chunked\r\n"
@@ -47,7 +48,9 @@ int web_page_handler(char *req, web_handler_t handler);
 int web_page_rx(int sock, char *req, int len);
 int web_resp_add_data(int sock, BYTE *data, int dlen);
 int web_resp_add_str(int sock, char *str);
+int web_resp_add_ref(int sock, const BYTE *data, int dlen, tx_release_t release);
 int web_resp_add_content_len(int sock, int n);
+int web_resp_space(int sock);
 int web_resp_send(int sock);
 
 // EOF
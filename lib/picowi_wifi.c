@@ -245,6 +245,41 @@ int wifi_data_write(int func, int addr, uint8_t *dp, int nbytes)
     return (nbytes);
 }
 
+// Write two data blocks using SPI, as one transfer padded to a multiple
+// of 4 bytes, so a header and its data needn't be copied into one buffer
+int wifi_data_write2(int func, int addr, uint8_t *dp1, int n1, uint8_t *dp2, int n2)
+{
+    static uint8_t zeros[4];
+    int pad = (4 - ((n1 + n2) & 3)) & 3;
+    SPI_MSG msg = {
+        .hdr = {
+         .wr = SD_WR,
+        .incr = 1,
+        .func = func&SD_FUNC_MASK,
+        .addr = addr,
+        .len = n1 + n2 + pad
+    }
+    };
+
+    if (func & SD_FUNC_SWAP)
+        msg.vals[0] = SWAP16_2(msg.vals[0]);
+#if !USE_PIO
+    io_mode(SD_CMD_PIN, IO_OUT);
+#endif    
+    io_out(SD_CS_PIN, 0);
+    wifi_spi_write((uint8_t *)&msg, 32);
+    wifi_spi_write(dp1, n1 * 8);
+    if (n2 > 0)
+        wifi_spi_write(dp2, n2 * 8);
+    if (pad)
+        wifi_spi_write(zeros, pad * 8);
+    io_out(SD_CS_PIN, 1);
+#if !USE_PIO
+    io_mode(SD_CMD_PIN, IO_IN);
+#endif    
+    return (n1 + n2 + pad);
+}
+
 // Read data block from SPI interface
 void wifi_spi_read(uint8_t *dp, int nbits)
 {
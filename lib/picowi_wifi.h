@@ -56,6 +56,7 @@ int wifi_start(void);
 void wifi_pio_init(void);
 int wifi_data_read(int func, int addr, uint8_t *dp, int nbytes);
 int wifi_data_write(int func, int addr, uint8_t *dp, int nbytes);
+int wifi_data_write2(int func, int addr, uint8_t *dp1, int n1, uint8_t *dp2, int n2);
 uint32_t wifi_reg_read(int func, uint32_t addr, int nbytes);
 int wifi_reg_write(int func, uint32_t addr, uint32_t val, int nbytes);
 void wifi_spi_read(uint8_t *dp, int nbits);
@@ -51,7 +51,7 @@ int main()
 {
     uint32_t led_ticks, poll_ticks, ping_ticks;
     bool ledon=false;
-    MACADDR mac;
+    MACADDR mac = {0};
     int i, ping_state=0, t;
     
     for (i=0; i<sizeof(ping_data); i++)
@@ -83,45 +83,23 @@ int main()
             {
                 wifi_set_led(ledon = !ledon);
                 ustimeout(&ping_ticks, 0);
-                // If LED is on, and we have joined a network..
+                // If LED is on, and we have joined a network, send ICMP
+                // request; with zero MAC address, it is sent after ARP
                 if (ledon && link_check()>0)
                 {
-                    // If not ARPed, send ARP request
-                    if (!ip_find_arp(hostip, mac))
-                    {
-                        ip_tx_arp(mac, hostip, ARPREQ);
-                        ping_state = 1;
-                    }
-                    // If ARPed, send ICMP request
-                    else
-                    {
-                        ip_tx_icmp(mac, hostip, ICREQ, 0, ping_data, sizeof(ping_data));
-                        ping_rx_time = 0;
-                        ping_state = 2;
-                    }
-                }
-            }
-            // If awaiting ARP response..
-            if (ping_state == 1)
-            {
-                // If we have an ARP response, send ICMP request
-                if (ip_find_arp(hostip, mac))
-                {
-                    ustimeout(&ping_ticks, 0);
                     ip_tx_icmp(mac, hostip, ICREQ, 0, ping_data, sizeof(ping_data));
                     ping_rx_time = 0;
-                    ping_state = 2;
+                    ping_state = 1;
                 }
             }
-            // Check for timeout on ARP or ICMP request
-            if ((ping_state==1 || ping_state==2) && 
-                ustimeout(&ping_ticks, PING_RESP_USEC))
+            // Check for timeout on ICMP request
+            if (ping_state == 1 && ustimeout(&ping_ticks, PING_RESP_USEC))
             {
-                printf("%s timeout\n", ping_state==1 ? "ARP" : "ICMP");
+                printf("ICMP timeout\n");
                 ping_state = 0;
             }
             // If ICMP response received, LED off, print time
-            else if (ping_state == 2 && ping_rx_time)
+            else if (ping_state == 1 && ping_rx_time)
             {
                 t = (ping_rx_time - ping_tx_time + 50) / 100;
                 printf("Round-trip time %d.%d ms\n", t/10, t%10);
@@ -133,6 +111,7 @@ int main()
             {
                 event_poll();
                 join_state_poll(SSID, PASSWD);
+                ip_arp_poll();
                 ustimeout(&poll_ticks, 0);
             }
         }
@@ -0,0 +1,128 @@
+// PicoWi TCP client example, see https://iosoft.blog/picowi
+//
+// Copyright (c) 2022, Jeremy P Bentham
+//
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files (the "Software"), to deal
+// in the Software without restriction, including without limitation the rights
+// to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+// copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions:
+//
+// The above copyright notice and this permission notice shall be included in all
+// copies or substantial portions of the Software.
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+// OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+// SOFTWARE.
+
+#include <stdio.h>
+#include <string.h>
+
+#include "lib/picowi_defs.h"
+#include "lib/picowi_pico.h"
+#include "lib/picowi_wifi.h"
+#include "lib/picowi_init.h"
+#include "lib/picowi_ioctl.h"
+#include "lib/picowi_event.h"
+#include "lib/picowi_join.h"
+#include "lib/picowi_ip.h"
+#include "lib/picowi_dhcp.h"
+#include "lib/picowi_net.h"
+#include "lib/picowi_tcp.h"
+#include "lib/picowi_web.h"
+
+// The hard-coded password is for test purposes only!!!
+#define SSID                "testnet"
+#define PASSWD              "testpass"
+
+// Address of server that collects the data
+#define SERVER_IP           IPADDR_VAL(192, 168, 1, 2)
+#define SERVER_PORT         8080
+
+#define CONNECT_USEC        5000000
+#define REPORT_USEC         1000000
+
+IPADDR server_ip = SERVER_IP;
+int report_count;
+
+int client_poll(int sock);
+
+int main()
+{
+    uint32_t led_ticks, connect_ticks=0;
+    bool ledon = false;
+    int sock = -1;
+    struct sockaddr_in server_addr;
+
+    set_display_mode(DISP_INFO | DISP_JOIN | DISP_TCP_STATE);
+    io_init();
+    usdelay(1000);
+    if (net_init() && net_join(SSID, PASSWD))
+    {
+        memset(&server_addr, 0, sizeof(server_addr));
+        server_addr.sin_family = AF_INET;
+        IP_CPY((BYTE *)&server_addr.sin_addr, server_ip);
+        server_addr.sin_port = htons(SERVER_PORT);
+        ustimeout(&led_ticks, 0);
+        while (1)
+        {
+            // Get any events, poll the network-join state machine
+            net_event_poll();
+            net_state_poll();
+            tcp_socks_poll();
+            // If DHCP complete, and not connected, start a connection
+            if (dhcp_complete && sock < 0 && ustimeout(&connect_ticks, CONNECT_USEC))
+            {
+                if ((sock = socket(AF_INET, SOCK_STREAM, 0)) >= 0 &&
+                    connect(sock, (struct sockaddr *)&server_addr, sizeof(server_addr)) == 0)
+                    printf("Connecting to %s:%u\n", inet_ntoa(server_addr.sin_addr), SERVER_PORT);
+                else if (sock >= 0)
+                {
+                    tcp_sock_close(sock);
+                    sock = -1;
+                }
+            }
+            // Exchange data with the server, until the socket is closed
+            else if (sock >= 0 && !client_poll(sock))
+                sock = -1;
+            // Toggle LED at 0.5 Hz if joined, 5 Hz if not
+            if (ustimeout(&led_ticks, link_check() > 0 ? 1000000 : 100000))
+                wifi_set_led(ledon = !ledon);
+        }
+    }
+}
+
+// Print any data received from the server, send a report every second,
+// and close the socket if the connection has been closed or has failed
+// Return 0 if the socket is closed, and can no longer be used
+int client_poll(int sock)
+{
+    static uint32_t report_ticks;
+    struct pollfd pfd = {.fd = sock, .events = POLLIN | POLLOUT};
+    char temps[50];
+    int n;
+
+    if (poll(&pfd, 1, 0) > 0)
+    {
+        if ((pfd.revents & POLLIN) && (n = recv(sock, temps, sizeof(temps), 0)) > 0)
+            printf("Rx %u bytes\n", n);
+        else if (pfd.revents & POLLIN)
+        {
+            tcp_sock_close(sock);
+            return (0);
+        }
+        else if ((pfd.revents & POLLOUT) && ustimeout(&report_ticks, REPORT_USEC))
+        {
+            sprintf(temps, "Report %u, time %lu usec\r\n", ++report_count, (unsigned long)ustime());
+            send(sock, temps, strlen(temps), 0);
+        }
+    }
+    return (1);
+}
+
+// EOF
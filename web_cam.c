@@ -42,7 +42,8 @@
 #include "camera/cam_2640.h"
 
 #define TEST_BLOCK_COUNT 100
-#define TCP_MAXDATA   1400
+#define VIDEO_HDR_MAXLEN 100
+#define VIDEO_PACE_RATE 1000000     // Max video data rate, bytes/sec (0 if none)
 
 // The hard-coded password is for test purposes only!!!
 #define SSID                "testnet"
@@ -57,10 +58,15 @@ extern BYTE cam_data[1024 * 30];
 
 char testblock[256*5 + 3];
 
+// Number of Tx segments referring to the camera data
+int cam_refs;
+
 int web_root_handler(int sock, char *req, int oset);
 int web_cam_handler(int sock, char *req, int oset);
 int web_video_handler(int sock, char *req, int oset);
 int web_favicon_handler(int sock, char *req, int oset);
+int web_cam_add_data(int sock, int oset, int n);
+void web_cam_release(int sock, const BYTE *data, int dlen);
 
 int main()
 {
@@ -133,6 +139,7 @@ int web_cam_handler(int sock, char *req, int oset)
     int n = 0, diff;
     static int captime = 0, startime = 0, hlen = 0, dlen = 0;
     NET_SOCKET *ts = &net_sockets[sock];
+    TCP_STATS stats;
     
     if (req)
     {
@@ -141,21 +148,26 @@ int web_cam_handler(int sock, char *req, int oset)
             HTTP_200_OK HTTP_SERVER HTTP_NOCACHE HTTP_CONNECTION_CLOSE
             HTTP_CONTENT_JPEG HTTP_HEADER_END);
         captime = ustime();
-        dlen = cam_capture_single();
+        // Don't overwrite an image that is still being sent
+        if (cam_refs == 0)
+            dlen = cam_capture_single();
         startime = ustime();
-        n += web_resp_add_data(sock, cam_data, TCP_MAXDATA - n);
+        n += web_cam_add_data(sock, 0, web_resp_space(sock));
     }
     else
     {
-        n = MIN(TCP_MAXDATA, dlen + hlen - oset);
+        n = MIN(web_resp_space(sock), dlen + hlen - oset);
         if (n > 0)
-            web_resp_add_data(sock, &cam_data[oset - hlen], n);
+            n = web_cam_add_data(sock, oset - hlen, n);
         else
         {
             tcp_sock_close(sock);
             diff = ustime() - startime;
             printf(RESOLUTION " capture %u usec, transfer %u bytes in %u usec, %u kbyte/s, %u errors\n",
                 startime-captime, dlen, diff, (dlen * 1000)/diff, ts->errors);
+            tcp_get_stats(sock, &stats);
+            printf("cwnd %u ssthresh %u, %u segments resent, %u dup ACKs\n",
+                ts->cwnd, ts->ssthresh, stats.retransmits, stats.dup_acks);
         }
     }
     return (n);
@@ -164,18 +176,30 @@ int web_cam_handler(int sock, char *req, int oset)
 // Handler for MJPEG video
 int web_video_handler(int sock, char *req, int oset)
 {
-    int n = 0;
+    int n = 0, cork = 1;
+    uint32_t rate = VIDEO_PACE_RATE;
     static int hlen = 0, dlen = -1;
     //NET_SOCKET *ts = &net_sockets[sock];
     
     if (req)
     {
         printf("\nTCP socket %d Rx %s\n", sock, strtok(req, "\n"));
+        // Cork the socket, so frame headers are sent with the image data
+        setsockopt(sock, IPPROTO_TCP, TCP_CORK, &cork, sizeof(cork));
+        // Pace the segments, so they don't arrive at the access point in bursts
+        if (rate)
+            setsockopt(sock, SOL_SOCKET, SO_MAX_PACING_RATE, &rate, sizeof(rate));
         hlen = n = web_resp_add_str(sock,
             HTTP_200_OK HTTP_SERVER HTTP_NOCACHE
             HTTP_MULTIPART HTTP_HEADER_END);
         dlen = -1;
     }
+    // If the frame header won't fit after the held data, get that sent first
+    else if (dlen == -1 && web_resp_space(sock) < VIDEO_HDR_MAXLEN)
+        n = 1;
+    // Wait until the previous image has been sent before capturing another
+    else if (dlen == -1 && cam_refs > 0)
+        n = 0;
     else if (dlen == -1)
     {
         dlen = cam_capture_single();
@@ -185,17 +209,30 @@ int web_video_handler(int sock, char *req, int oset)
         n += web_resp_add_str(sock, HTTP_HEADER_END);
         hlen = oset + n;
     }
+    else if (dlen + hlen - oset <= 0)
+        dlen = -1;
+    else if ((n = web_resp_space(sock)) > 0)
+        n = web_cam_add_data(sock, oset - hlen, MIN(n, dlen + hlen - oset));
     else
-    {
-        n = MIN(TCP_MAXDATA, dlen + hlen - oset);
-        if (n > 0)
-            web_resp_add_data(sock, &cam_data[oset - hlen], n);
-        else
-            dlen = -1;
-    }
+        n = 1;
     return (n);
 }
 
+// Add a reference to camera data, so it is sent without copying
+int web_cam_add_data(int sock, int oset, int n)
+{
+    if ((n = web_resp_add_ref(sock, &cam_data[oset], n, web_cam_release)) > 0)
+        cam_refs++;
+    return (n);
+}
+
+// Camera data has been acknowledged, or the socket closed
+void web_cam_release(int sock, const BYTE *data, int dlen)
+{
+    if (cam_refs > 0)
+        cam_refs--;
+}
+
 // Handler for favicon
 int web_favicon_handler(int sock, char *req, int oset)
 {
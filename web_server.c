@@ -55,6 +55,7 @@ const char b64chars[] = "ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz012
 extern IPADDR my_ip, router_ip;
 extern int dhcp_complete;
 extern NET_SOCKET net_sockets[NUM_NET_SOCKETS];
+extern char *tstate_strings[];
 
 BYTE testdata[256 * 3];
 char testblock[256 * 5 + 3];
@@ -85,6 +86,8 @@ SERVER_ARG server_args[] = {
 
 int web_status_handler(int sock, char *req, int oset);
 int web_json_status(char *buff, int maxlen);
+int web_tcpstats_handler(int sock, char *req, int oset);
+int web_json_tcpstats(char *buff, int maxlen);
 int web_root_handler(int sock, char *req, int oset);
 int web_data_handler(int sock, char *req, int oset);
 int web_bin_data_handler(int sock, char *req, int oset);
@@ -123,6 +126,7 @@ int main()
         printf("Web server on port %u\n", HTTPORT);
         web_page_handler("GET /favicon.ico", web_favicon_handler);
         web_page_handler("GET /status.txt", web_status_handler);
+        web_page_handler("GET /tcpstats.txt", web_tcpstats_handler);
         web_page_handler("GET /data.txt", web_data_handler);
         web_page_handler("GET /data.bin", web_bin_data_handler);
         web_page_handler("GET /", web_root_handler);
@@ -186,6 +190,39 @@ int web_json_status(char *buff, int maxlen)
     return (n += sprintf(&buff[n], "}"));
 }
 
+// Handler for TCP statistics page
+int web_tcpstats_handler(int sock, char *req, int oset)
+{
+    int n;
+
+    web_json_tcpstats(temps, sizeof(temps) - 1);
+    n = web_resp_add_str(sock,
+        HTTP_200_OK HTTP_SERVER HTTP_NOCACHE HTTP_ORIGIN_ANY
+        HTTP_CONTENT_JSON HTTP_CONNECTION_CLOSE HTTP_HEADER_END) +
+        web_resp_add_str(sock, temps);
+    tcp_sock_close(sock);
+    return (n);
+}
+
+// Return TCP statistics for all sockets as json string
+int web_json_tcpstats(char *buff, int maxlen)
+{
+    TCP_STATS st;
+    int i, n;
+
+    tcp_get_stats(-1, &st);
+    n = sprintf(buff, "{\"segs_in\":%u,\"segs_out\":%u,\"bytes_in\":%u,\"bytes_out\":%u,"
+        "\"retransmits\":%u,\"dup_acks\":%u,\"ooo_segs\":%u,\"ooo_drops\":%u,"
+        "\"zero_wins_rx\":%u,\"zero_wins_tx\":%u,\"win_probes\":%u,\"rtt_samples\":%u,"
+        "\"paws_drops\":%u,\"state_msec\":{",
+        st.segs_in, st.segs_out, st.bytes_in, st.bytes_out, st.retransmits, st.dup_acks,
+        st.ooo_segs, st.ooo_drops, st.zero_wins_rx, st.zero_wins_tx, st.win_probes,
+        st.rtt_samples, st.paws_drops);
+    for (i = 1; i < T_NUM_STATES && n < maxlen - 40; i++)
+        n += sprintf(&buff[n], "%s\"%s\":%u", i > 1 ? "," : "", tstate_strings[i], st.state_msec[i]);
+    return (n += sprintf(&buff[n], "}}"));
+}
+
 // Handler for test data Web page
 int web_data_handler(int sock, char *req, int oset)
 {
@@ -216,11 +253,11 @@ int web_data_handler(int sock, char *req, int oset)
         {
             tcp_sock_close(sock);
             diff = ustime() - startime;
-            printf("%u bytes in %u usec, %u kbyte/s, %u errors\n",
+            printf("%u bytes in %u usec, %u kbyte/s, %u errors, RTT %lu usec\n",
                 count*sizeof(testblock),
                 diff,
                 (count*sizeof(testblock) * 1000)/diff,
-                ts->errors);
+                ts->errors, (unsigned long)tcp_sock_srtt(sock));
         }
     }
     return (n);
@@ -232,6 +269,7 @@ int web_bin_data_handler(int sock, char *req, int oset)
     int n = 0, diff;
     static int count = 0, last_oset = 0, startime;
     NET_SOCKET *ts = &net_sockets[sock];
+    TCP_STATS stats;
 
     if (req)
     {
@@ -257,11 +295,14 @@ int web_bin_data_handler(int sock, char *req, int oset)
         {
             tcp_sock_close(sock);
             diff = ustime() - startime;
-            printf("%u bytes in %u usec, %u kbyte/s, %u errors\n",
+            printf("%u bytes in %u usec, %u kbyte/s, %u errors, RTT %lu usec\n",
                 count*sizeof(testdata),
                 diff,
                 (count*sizeof(testdata) * 1000)/diff,
-                ts->errors);
+                ts->errors, (unsigned long)tcp_sock_srtt(sock));
+            tcp_get_stats(sock, &stats);
+            printf("cwnd %u ssthresh %u, %u segments resent, %u dup ACKs\n",
+                ts->cwnd, ts->ssthresh, stats.retransmits, stats.dup_acks);
         }
     }
     return (n);